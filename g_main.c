@@ -41,40 +41,202 @@ static char base_directory[260];
 static size_t base_directory_len;
 static char save_directory[260];
 static size_t save_directory_len;
-static int32_t max_clients;
+int32_t max_clients;
+static cvar_t *sys_wasmsavetimes;
 
-static bool wasm_attempt_assembly_load(const char *file)
+// with sys_wasmtrusted, the SHA-256 that decides if the module is
+// trusted; taken before WAMR loads it, since it patches the buffer
+static bool module_digest_wanted, module_digest_valid;
+static uint8_t module_digest[32];
+
+static bool wasm_digest_file(const char *path)
 {
-	char path[64];
-	snprintf(path, sizeof(path), "%s/%s", base_directory, file);
+	uint32_t size;
+	uint8_t *data = q2_wasm_load_module(path, false, &size);
 
-	FILE *fp = fopen(path, "rb+");
+	if (!data)
+		return false;
 
-	if (fp == NULL)
-	{
-		gi.dprintf("Couldn't load %s: file does not exist\n", file);
+	q2_wasm_module_digest(data, size, module_digest);
+	q2_wasm_free_module(data, size, false);
+
+	return true;
+}
+
+// AoT modules are mapped rather than read; see q2_wasm_load_module
+static bool wasm_attempt_assembly_load(const char *path, bool aot)
+{
+	uint32_t size;
+	uint8_t *assembly = q2_wasm_load_module(path, aot, &size);
+
+	if (assembly == NULL)
 		return false;
+
+	if (module_digest_wanted)
+	{
+		q2_wasm_module_digest(assembly, size, module_digest);
+		module_digest_valid = true;
 	}
-	
-	fseek(fp, 0, SEEK_END);
-	uint32_t size = ftell(fp);
-	fseek(fp, 0, SEEK_SET);
-	wasm.assembly = (uint8_t *) gi.TagMalloc(size, TAG_GAME);
-	fread(wasm.assembly, sizeof(uint8_t), size, fp);
-	fclose(fp);
 
 	/* parse the WASM file from buffer and create a WASM module */
-	wasm.wasm_module = wasm_runtime_load(wasm.assembly, size, wasm.error_buf, sizeof(wasm.error_buf));
+	wasm.wasm_module = wasm_runtime_load(assembly, size, wasm.error_buf, sizeof(wasm.error_buf));
 
 	if (!wasm.wasm_module)
 	{
-		gi.TagFree(wasm.assembly);
+		q2_wasm_free_module(assembly, size, aot);
 		return false;
 	}
 
+	wasm.assembly = assembly;
+	wasm.assembly_size = size;
+	wasm.assembly_mapped = aot;
+
+	return true;
+}
+
+// Execution tiers, in the order sys_wasmmode auto tries them. Everything
+// but AoT runs game.wasm; tiered starts on Fast JIT and has WAMR recompile
+// hot functions with LLVM on background threads, swapping them in as they
+// finish. Which interpreter "interp" gets, classic or fast, is decided when
+// WAMR is built.
+typedef struct
+{
+	const char	*name;
+	bool		aot;
+	RunningMode	mode;
+} wasm_exec_mode_t;
+
+static const wasm_exec_mode_t wasm_exec_modes[] = {
+	{ "aot", true, (RunningMode) 0 },	// AoT code has no running mode
+	{ "tiered", false, Mode_Multi_Tier_JIT },
+	{ "llvmjit", false, Mode_LLVM_JIT },
+	{ "fastjit", false, Mode_Fast_JIT },
+	{ "interp", false, Mode_Interp }
+};
+
+// Hand-built AoT modules: game.aot, plus optionally variants tagged with
+// the x86-64 level they were compiled for (game.x86-64-v3.aot and so on).
+// game.aot is the one to fall back to, so it should target plain x86-64.
+static bool wasm_attempt_aot_file(const char *file, bool optional)
+{
+	char path[sizeof(base_directory) + 32];
+	snprintf(path, sizeof(path), "%s/%s", base_directory, file);
+
+	if (optional && !q2_wasm_aot_exists(path))
+		return false;
+
+	if (q2_wasm_aot_is_stale(path))
+	{
+		gi.dprintf("%s is older than game.wasm; ignoring it\n", file);
+		return false;
+	}
+
+	return wasm_attempt_assembly_load(path, true);
+}
+
+static bool wasm_attempt_exec_mode(const wasm_exec_mode_t *exec_mode, bool requested)
+{
+	if (!exec_mode->aot)
+	{
+		if (!wasm_runtime_is_running_mode_supported(exec_mode->mode))
+		{
+			if (requested)
+				gi.dprintf("sys_wasmmode %s isn't supported by this WAMR build\n", exec_mode->name);
+
+			return false;
+		}
+
+		wasm_runtime_set_default_running_mode(exec_mode->mode);
+	}
+
+	if (exec_mode->aot)
+	{
+		// the cached module for this exact game.wasm, if
+		// there is one, beats anything dropped in by hand
+		const char *cache_path = q2_wasm_aot_cache_path();
+
+		if (cache_path && wasm_attempt_assembly_load(cache_path, true))
+		{
+			// it's trusted if the game.wasm it was compiled from is
+			if (module_digest_wanted)
+			{
+				char path[sizeof(base_directory) + 16];
+				snprintf(path, sizeof(path), "%s/game.wasm", base_directory);
+
+				module_digest_valid = wasm_digest_file(path);
+			}
+
+			q2_wasm_aot_cache_used();
+			gi.dprintf("WASM: running game in %s mode from the AoT cache\n", exec_mode->name);
+			return true;
+		}
+
+		// builds for a higher x86-64 level than the CPU has would crash
+		// on the first instruction it lacks, so only those up to it count
+		for (int32_t level = q2_wasm_aot_cpu_level(); level >= 2; level--)
+		{
+			char file[32];
+			snprintf(file, sizeof(file), "game.x86-64-v%i.aot", level);
+
+			if (wasm_attempt_aot_file(file, true))
+			{
+				gi.dprintf("WASM: running game in %s mode from %s\n", exec_mode->name, file);
+				return true;
+			}
+		}
+
+		if (!wasm_attempt_aot_file("game.aot", false))
+			return false;
+	}
+	else
+	{
+		char path[sizeof(base_directory) + 16];
+		snprintf(path, sizeof(path), "%s/game.wasm", base_directory);
+
+		if (!wasm_attempt_assembly_load(path, false))
+			return false;
+	}
+
+	gi.dprintf("WASM: running game in %s mode\n", exec_mode->name);
 	return true;
 }
 
+static const wasm_exec_mode_t *exec_mode;
+
+static const wasm_exec_mode_t *wasm_load_assembly(const char *mode)
+{
+	for (size_t i = 0; i < lengthof(wasm_exec_modes); i++)
+	{
+		if (stricmp(mode, wasm_exec_modes[i].name) == 0)
+		{
+			if (wasm_attempt_exec_mode(&wasm_exec_modes[i], true))
+				return &wasm_exec_modes[i];
+
+			gi.dprintf("sys_wasmmode %s didn't work out, picking one automatically\n", mode);
+			break;
+		}
+	}
+
+	bool tried_wasm = false;
+
+	for (size_t i = 0; i < lengthof(wasm_exec_modes); i++)
+	{
+		const wasm_exec_mode_t *candidate = &wasm_exec_modes[i];
+
+		// the best tier this build has is the only one worth loading game.wasm for
+		if (!candidate->aot && (tried_wasm || !wasm_runtime_is_running_mode_supported(candidate->mode)))
+			continue;
+
+		if (wasm_attempt_exec_mode(candidate, false))
+			return candidate;
+
+		tried_wasm |= !candidate->aot;
+	}
+
+	wasm_error("Unable to load game.aot or game.wasm");
+	return NULL;
+}
+
 static void pre_sync_entities(void)
 {
 	for (int32_t i = 0; i < globals.num_edicts; i++)
@@ -96,6 +258,9 @@ static void post_sync_entities(void)
 
 	for (int32_t i = 0; i < num_sync; i++)
 		sync_entity(entity_number_to_wnp(i), entity_number_to_np(i), false);
+
+	// anything the game deferred goes out now that its entities are in sync
+	q2_wasm_drain_deferred();
 }
 
 static void wasm_fetch_edict_base(void)
@@ -109,7 +274,7 @@ static void wasm_fetch_edict_base(void)
 	wasm.edict_end = wasm.edicts + (wasm.edict_size * wasm.max_edicts);
 
 	// Validate the entity space
-	if (!wasm_runtime_validate_app_addr(wasm.module_inst, wasm.edicts, wasm.edict_end - wasm.edicts))
+	if (!wasm_validate_addr(wasm.edicts, wasm.edict_end - wasm.edicts))
 		wasm_error("InitWASMAPI returned invalid memory");
 }
 
@@ -158,6 +323,17 @@ static void NormalizeSavePath(const char *input_path, char *path, size_t path_si
 	snprintf(path, path_size, ".saves/%s", input_path + save_directory_len + 1);
 }
 
+// the reverse of the above, for paths the game hands to the save stream
+// imports; anything outside of .saves is refused.
+bool q2_wasm_native_save_path(const char *path, char *native_path, size_t native_path_size)
+{
+	if (strncmp(path, ".saves/", 7) || strstr(path, "..") || strchr(path, ':'))
+		return false;
+
+	snprintf(native_path, native_path_size, "%s/%s", save_directory, path + 7);
+	return true;
+}
+
 /*
 ============
 InitGame
@@ -170,20 +346,63 @@ is loaded.
 static void InitGame(void)
 {
 	cvar_t *sys_wasmstacksize = gi.cvar("sys_wasmstacksize", "8388608", CVAR_LATCH);
-	cvar_t *sys_wasmheapsize = gi.cvar("sys_wasmstacksize", "100663296", CVAR_LATCH);
+	cvar_t *sys_wasmheapsize = gi.cvar("sys_wasmheapsize", "8388608", CVAR_LATCH);
+	cvar_t *sys_wasmmode = gi.cvar("sys_wasmmode", "auto", CVAR_LATCH);
+	cvar_t *sys_wasmaotcompiler = gi.cvar("sys_wasmaotcompiler", "wamrc", CVAR_LATCH);
+	cvar_t *sys_wasmprofdata = gi.cvar("sys_wasmprofdata", "llvm-profdata", CVAR_LATCH);
+	cvar_t *sys_wasmpgo = gi.cvar("sys_wasmpgo", "0", CVAR_LATCH);
+	cvar_t *sys_wasmrawimports = gi.cvar("sys_wasmrawimports", "1", CVAR_LATCH);
+	cvar_t *sys_wasmimporttimes = gi.cvar("sys_wasmimporttimes", "0", CVAR_LATCH);
+	cvar_t *sys_wasmtrusted = gi.cvar("sys_wasmtrusted", "0", CVAR_LATCH);
+	cvar_t *sys_wasmhugepages = gi.cvar("sys_wasmhugepages", "0", CVAR_LATCH);
+	cvar_t *sys_wasmprefault = gi.cvar("sys_wasmprefault", "0", CVAR_LATCH);
+	cvar_t *sys_wasmdeferimports = gi.cvar("sys_wasmdeferimports", "0", CVAR_LATCH);
+	cvar_t *sys_wasmasyncsave = gi.cvar("sys_wasmasyncsave", "0", CVAR_LATCH);
+	cvar_t *sys_wasmimagesaves = gi.cvar("sys_wasmimagesaves", "0", CVAR_LATCH);
+	cvar_t *sys_wasmramautosaves = gi.cvar("sys_wasmramautosaves", "0", CVAR_LATCH);
+	cvar_t *sys_wasmleveldeltas = gi.cvar("sys_wasmleveldeltas", "0", CVAR_LATCH);
+	sys_wasmsavetimes = gi.cvar("sys_wasmsavetimes", "0", 0);
 
 	InitializeDirectories();
 
-	/* initialize the wasm runtime by default configurations */
-	wasm_runtime_init();
+	q2_wasm_init_ram_saves(sys_wasmramautosaves->value != 0);
+	q2_wasm_init_level_deltas(sys_wasmleveldeltas->value != 0);
+
+#ifdef KMQUAKE2_ENGINE_MOD
+	q2_wasm_init_configstring_remap();
+#endif
+
+	/* initialize the wasm runtime, with memory coming from us */
+	RuntimeInitArgs init_args;
+	memset(&init_args, 0, sizeof(init_args));
 
-	if (!RegisterApiNatives())
+	q2_wasm_init_runtime_memory(&init_args, (int32_t) sys_wasmhugepages->value, (int32_t) sys_wasmprefault->value);
+
+	if (!wasm_runtime_full_init(&init_args))
+		wasm_error("Unable to initialize the WASM runtime");
+
+	if (!RegisterApiNatives(sys_wasmrawimports->value != 0, sys_wasmimporttimes->value != 0))
 		wasm_error("Unable to initialize API natives");
 
-	/* read WASM file into a memory buffer */
-	if (!wasm_attempt_assembly_load("game.aot") &&
-		!wasm_attempt_assembly_load("game.wasm"))
-		wasm_error("Unable to load game.aot or game.wasm");
+	q2_wasm_init_aot_cache(base_directory, sys_wasmaotcompiler->string, sys_wasmprofdata->string, sys_wasmpgo->value != 0);
+
+	module_digest_wanted = sys_wasmtrusted->value != 0;
+	module_digest_valid = false;
+
+	/* read WASM file into a memory buffer; if that had to be bytecode,
+	   have it compiled so the next start can use native code */
+	exec_mode = wasm_load_assembly(sys_wasmmode->string);
+	q2_wasm_aot_cache_update(exec_mode->aot);
+
+	// the LLVM JIT compiles functions on threads of its own
+	q2_wasm_init_async_save(sys_wasmasyncsave->value != 0,
+		!exec_mode->aot && (exec_mode->mode == Mode_LLVM_JIT || exec_mode->mode == Mode_Multi_Tier_JIT));
+
+	// only for modules we built ourselves and listed by hash
+	wasm.trusted = module_digest_valid && q2_wasm_module_trusted(base_directory, module_digest);
+
+	if (wasm.trusted)
+		gi.dprintf("Game module is trusted, skipping the bridge's API usage checks\n");
 
 	static const char *dir_list[2];
 	dir_list[0] = gi.cvar("game", "", 0)->string;
@@ -201,6 +420,8 @@ static void InitGame(void)
 	if (!wasm.module_inst)
 		wasm_error(wasm.error_buf);
 
+	wasm_reset_memory();
+
 	wasm.exec_env = wasm_runtime_create_exec_env(wasm.module_inst, (uint32_t) sys_wasmstacksize->value);
 
 	if (!wasm.exec_env)
@@ -238,12 +459,19 @@ static void InitGame(void)
 	LOAD_FUNC(WriteLevel, "($)");
 	LOAD_FUNC(ReadLevel, "($)");
 
+	wasm.aot_direct = exec_mode->aot && q2_wasm_aot_direct_init();
+
+	q2_wasm_init_image_saves(sys_wasmimagesaves->value != 0, (uint32_t) sys_wasmheapsize->value);
+
 	// allocate buffer data we use for transferring data over to WASM
-	wasm.buffers_addr = wasm_runtime_module_malloc(wasm.module_inst, sizeof(wasm_buffers_t), NULL);
+	wasm.buffers_addr = wasm_module_malloc(sizeof(wasm_buffers_t), NULL);
 
 	if (!wasm.buffers_addr)
 		wasm_error("Unable to allocate WASM buffers memory");
 
+	// has to be set up before GetGameAPI, since that's where the game asks for it
+	q2_wasm_init_deferred(sys_wasmdeferimports->value != 0);
+
 	uint32_t args[1] = {
 		GAME_API_EXTENDED_VERSION
 	};
@@ -253,6 +481,9 @@ static void InitGame(void)
 	wasm_call_args(wasm.WASM_GetEdictSize, args, 0);
 	wasm.edict_size = args[0];
 
+	if (wasm.edict_size > 0)
+		wasm.edict_size_recip = ((1ull << 32) + wasm.edict_size - 1) / wasm.edict_size;
+
 	wasm_call(wasm.WASM_Init);
 	
 	wasm_call_args(wasm.WASM_GetMaxEdicts, args, 0);
@@ -284,27 +515,15 @@ static void InitGame(void)
 	post_sync_entities();
 }
 
-#ifndef min
-#define min(a, b) \
-	(a) < (b) ? (a) : (b)
-#endif
-
-// copies all of the command buffer data into WASM heap
-static void setup_args()
+static void ShutdownGame(void)
 {
-	wasm_buffers_t *buffers = wasm_buffers();
-
-	const int32_t n = min((sizeof(buffers->cmds) / sizeof(*buffers->cmds)) - 1, (uint32_t) gi.argc());
-	int32_t i;
+	q2_wasm_shutdown_async_save();
+	q2_wasm_close_save_files();
+	q2_wasm_shutdown_ram_saves();
 
-	for (i = 0; i < n; i++)
-		strlcpy(buffers->cmds[i], gi.argv(i), sizeof(buffers->cmds[i]));
-	buffers->cmds[i][0] = 0;
-	strlcpy(buffers->scmd, gi.args(), sizeof(buffers->scmd));
-}
+	if (wasm.module_inst)
+		q2_wasm_aot_cache_shutdown();
 
-static void ShutdownGame(void)
-{
 	if (wasm.exec_env)
 		wasm_runtime_destroy_exec_env(wasm.exec_env);
 
@@ -314,36 +533,74 @@ static void ShutdownGame(void)
 	if (wasm.wasm_module)
 		wasm_runtime_unload(wasm.wasm_module);
 
+	// the module may still point into its file until it's unloaded
+	if (wasm.assembly)
+	{
+		q2_wasm_free_module(wasm.assembly, wasm.assembly_size, wasm.assembly_mapped);
+		wasm.assembly = NULL;
+	}
+
 	wasm_runtime_destroy();
 
+	q2_wasm_shutdown_runtime_memory();
+
+	wasm_pool_shutdown();
+
 	gi.FreeTags(TAG_GAME);
 	gi.FreeTags(TAG_LEVEL);
 }
 
+// runs the game's WriteLevel on the level as it was just spawned,
+// for level files to be written as deltas against
+static void capture_level_base(void)
+{
+	char path[sizeof(save_directory) + 16];
+	wasm_buffers_t *buffers = wasm_buffers();
+
+	snprintf(path, sizeof(path), "%s/wasm_spawn.tmp", save_directory);
+
+	NormalizeSavePath(path, buffers->filename, sizeof(buffers->filename));
+
+	uint32_t args[] = {
+		WASM_BUFFERS_OFFSET(filename)
+	};
+
+	wasm_call_args(wasm.WASM_WriteLevel, args, lengthof(args));
+
+	q2_wasm_drain_deferred();
+
+	q2_wasm_capture_level_base(path);
+}
+
 static void SpawnEntities(const char *mapname, const char *entities, const char *spawnpoint)
 {
-	static uint32_t mapname_str, entities_str, spawnpoint_str;
+	q2_wasm_save_level_changed();
+
+	// the engine starts the new level with all configstrings cleared
+	q2_wasm_clear_configstrings();
 
 	gi.FreeTags(TAG_LEVEL);
-	
-	if (mapname_str)
-	{
-		q2_wasm_clear_surface_cache();
 
-		wasm_runtime_module_free(wasm.module_inst, mapname_str);
-		wasm_runtime_module_free(wasm.module_inst, entities_str);
-		wasm_runtime_module_free(wasm.module_inst, spawnpoint_str);
-	}
+	q2_wasm_clear_index_cache();
+	q2_wasm_clear_surface_cache();
+
+	q2_wasm_image_level_changed();
+
+	// these stay valid until the next map, same as before
+	wasm_staging_begin((uint32_t) (strlen(mapname) + strlen(entities) + strlen(spawnpoint) + 3));
 
 	uint32_t args[] = {
-		mapname_str = wasm_dup_str(mapname),
-		entities_str = wasm_dup_str(entities),
-		spawnpoint_str = wasm_dup_str(spawnpoint)
+		wasm_staging_dup_str(mapname),
+		wasm_staging_dup_str(entities),
+		wasm_staging_dup_str(spawnpoint)
 	};
 
 	wasm_call_args(wasm.WASM_SpawnEntities, args, lengthof(args));
 
 	post_sync_entities();
+
+	if (q2_wasm_level_deltas_enabled())
+		capture_level_base();
 }
 
 static qboolean ClientConnect(edict_t *e, char *userinfo)
@@ -430,7 +687,7 @@ static void ClientCommand(edict_t *e)
 {
 	q2_wasm_update_cvars();
 
-	setup_args();
+	q2_wasm_reset_args();
 
 	uint32_t edict_offset = entity_np_to_wa(e);
 
@@ -453,34 +710,95 @@ static void ClientThink(edict_t *e, usercmd_t *ucmd)
 	
 	pre_sync_entities();
 
-	uint32_t edict_offset = entity_np_to_wa(e);
-
-	uint32_t args[] = {
-		edict_offset,
-		WASM_BUFFERS_OFFSET(ucmd)
-	};
-
-	wasm_call_args(wasm.WASM_ClientThink, args, lengthof(args));
+	q2_wasm_call_client_think(entity_np_to_wa(e), WASM_BUFFERS_OFFSET(ucmd));
 
 	post_sync_entities();
 }
 
 static void RunFrame(void)
 {
+	q2_wasm_frame_begin();
+
 	q2_wasm_update_cvars();
 
 	pre_sync_entities();
 
-	wasm_call(wasm.WASM_RunFrame);
+	q2_wasm_call_run_frame();
 
 	post_sync_entities();
+
+	q2_wasm_end_frame();
+
+	q2_wasm_save_end_frame();
+
+	q2_wasm_commit_ram_saves();
+
+	q2_wasm_image_end_frame();
+
+	q2_wasm_frame_end();
+}
+
+// sv wasm_bench [count]: the cost of a call into the module and back.
+// GetNumEdicts does next to nothing on the other side, so it's all
+// crossing; timed through wasm_call_args, and through a direct call
+// into AoT code when there is one.
+static void CrossingBenchmark(void)
+{
+	int32_t count = gi.argc() > 2 ? atoi(gi.argv(2)) : 100000;
+
+	if (count < 1)
+		count = 1;
+
+	uint32_t args[1];
+
+	uint64_t start = wasm_time_nsec();
+
+	for (int32_t i = 0; i < count; i++)
+		wasm_call_args(wasm.WASM_GetNumEdicts, args, 0);
+
+	const uint64_t generic = wasm_time_nsec() - start;
+
+	int32_t num_edicts;
+
+	if (!q2_wasm_call_get_num_edicts_direct(&num_edicts))
+	{
+		gi.dprintf("crossings (%s): %.1f ns each, %i calls\n", exec_mode->name, (double) generic / count, count);
+		return;
+	}
+
+	start = wasm_time_nsec();
+
+	for (int32_t i = 0; i < count; i++)
+		q2_wasm_call_get_num_edicts_direct(&num_edicts);
+
+	const uint64_t direct = wasm_time_nsec() - start;
+
+	gi.dprintf("crossings (%s): %.1f ns generic, %.1f ns direct, %i calls each\n", exec_mode->name,
+		(double) generic / count, (double) direct / count, count);
 }
 
 static void ServerCommand(void)
 {
+	// bridge commands; these don't reach the game
+	if (stricmp(gi.argv(1), "wasm_stats") == 0)
+	{
+		q2_wasm_print_stats();
+		return;
+	}
+	else if (stricmp(gi.argv(1), "wasm_bench") == 0)
+	{
+		CrossingBenchmark();
+		return;
+	}
+	else if (stricmp(gi.argv(1), "wasm_framebench") == 0)
+	{
+		q2_wasm_frame_bench();
+		return;
+	}
+
 	q2_wasm_update_cvars();
 
-	setup_args();
+	q2_wasm_reset_args();
 
 	pre_sync_entities();
 
@@ -491,33 +809,71 @@ static void ServerCommand(void)
 
 static void WriteGame(const char *filename, qboolean autosave)
 {
-	wasm_buffers_t *buffers = wasm_buffers();
+	// the engine copies the save directory as soon as this returns,
+	// so any level still being written has to be finished first; an
+	// autosave in the store is written to where it's copied to instead
+	q2_wasm_join_save(true);
 
-	NormalizeSavePath(filename, buffers->filename, sizeof(buffers->filename));
+	if (!autosave)
+		q2_wasm_flush_ram_saves();
 
-	uint32_t args[] = {
-		WASM_BUFFERS_OFFSET(filename),
-		(uint32_t) autosave
-	};
+	const uint64_t start = wasm_time_nsec();
+
+	if (q2_wasm_image_saves_enabled())
+		q2_wasm_write_image(filename);
+	else
+	{
+		wasm_buffers_t *buffers = wasm_buffers();
+
+		NormalizeSavePath(filename, buffers->filename, sizeof(buffers->filename));
+
+		uint32_t args[] = {
+			WASM_BUFFERS_OFFSET(filename),
+			(uint32_t) autosave
+		};
+
+		q2_wasm_ram_autosave(autosave);
+
+		wasm_call_args(wasm.WASM_WriteGame, args, lengthof(args));
+
+		q2_wasm_ram_autosave(false);
 
-	wasm_call_args(wasm.WASM_WriteGame, args, lengthof(args));
+		q2_wasm_drain_deferred();
+	}
+
+	if (autosave)
+		q2_wasm_ram_mirror_autosave(filename);
+
+	if (sys_wasmsavetimes->value)
+		q2_wasm_report_save_time("WriteGame", start);
 }
 
 static void ReadGame(const char *filename)
 {
-	wasm_buffers_t *buffers = wasm_buffers();
+	q2_wasm_join_save(true);
 
-	NormalizeSavePath(filename, buffers->filename, sizeof(buffers->filename));
+	const uint64_t start = wasm_time_nsec();
 
-	uint32_t args[] = {
-		WASM_BUFFERS_OFFSET(filename)
-	};
+	// images can be read regardless of sys_wasmimagesaves
+	if (!q2_wasm_read_game_image(filename))
+	{
+		wasm_buffers_t *buffers = wasm_buffers();
+
+		NormalizeSavePath(filename, buffers->filename, sizeof(buffers->filename));
 
-	wasm_call_args(wasm.WASM_ReadGame, args, lengthof(args));
+		uint32_t args[] = {
+			WASM_BUFFERS_OFFSET(filename)
+		};
+
+		wasm_call_args(wasm.WASM_ReadGame, args, lengthof(args));
+	}
 
 	wasm_fetch_edict_base();
 
 	post_sync_entities();
+
+	if (sys_wasmsavetimes->value)
+		q2_wasm_report_save_time("ReadGame", start);
 }
 
 static void WriteLevel(const char *filename)
@@ -530,6 +886,7 @@ static void WriteLevel(const char *filename)
 	// will have all of them set to false.
 	bool backup[MAX_CLIENTS];
 	bool is_autosave = true;
+	const uint64_t start = wasm_time_nsec();
 
 	for (int32_t i = 0; i < max_clients; i++)
 	{
@@ -560,7 +917,23 @@ static void WriteLevel(const char *filename)
 		WASM_BUFFERS_OFFSET(filename)
 	};
 
-	wasm_call_args(wasm.WASM_WriteLevel, args, lengthof(args));
+	q2_wasm_ram_autosave(is_autosave);
+
+	const bool async = q2_wasm_async_save(wasm.WASM_WriteLevel, args, lengthof(args), filename);
+
+	if (!async)
+		wasm_call_args(wasm.WASM_WriteLevel, args, lengthof(args));
+
+	q2_wasm_ram_autosave(false);
+
+	q2_wasm_drain_deferred();
+
+	q2_wasm_write_level_delta(filename, async);
+
+	q2_wasm_image_level_written(filename);
+
+	if (sys_wasmsavetimes->value)
+		q2_wasm_report_save_time("WriteLevel", start);
 	
 	if (is_autosave)
 	{
@@ -572,19 +945,82 @@ static void WriteLevel(const char *filename)
 	}
 }
 
+// After a level comes back from an image, the engine's side of the
+// entities has to be rebuilt, which the game's ReadLevel would've done
+// by linking everything it loaded.
+static void relink_image_entities(void)
+{
+	const int32_t wasm_num = wasm_num_edicts();
+	const int32_t num_sync = max(globals.num_edicts, wasm_num);
+
+	for (int32_t i = 1; i < globals.num_edicts; i++)
+		gi.unlinkentity(entity_number_to_np(i));
+
+	globals.num_edicts = wasm_num;
+
+	for (int32_t i = 0; i < num_sync; i++)
+		sync_entity(entity_number_to_wnp(i), entity_number_to_np(i), true);
+
+	for (int32_t i = 1; i < wasm_num; i++)
+	{
+		wasm_edict_t *wasm_edict = entity_number_to_wnp(i);
+
+		// area.prev is only set if it was linked when the image was made
+		if (!wasm_edict->inuse || !wasm_edict->area.prev)
+			continue;
+
+		edict_t *native_edict = entity_number_to_np(i);
+
+		copy_link_wasm_to_native(native_edict, wasm_edict);
+		gi.linkentity(native_edict);
+		copy_link_native_to_wasm(wasm_edict, native_edict);
+	}
+}
+
 static void ReadLevel(const char *filename)
 {
-	wasm_buffers_t *buffers = wasm_buffers();
-	
-	NormalizeSavePath(filename, buffers->filename, sizeof(buffers->filename));
+	q2_wasm_join_save(true);
 
-	uint32_t args[] = {
-		WASM_BUFFERS_OFFSET(filename)
-	};
+	const uint64_t start = wasm_time_nsec();
 
-	wasm_call_args(wasm.WASM_ReadLevel, args, lengthof(args));
+	// the engine has just replaced the configstrings
+	// from the save, so anything we knew about them is stale
+	q2_wasm_clear_index_cache();
+	q2_wasm_clear_configstrings();
 
-	post_sync_entities();
+	if (q2_wasm_read_level_image(filename))
+	{
+		wasm_fetch_edict_base();
+		relink_image_entities();
+	}
+	else if (q2_wasm_save_missing(filename))
+		gi.dprintf("WARNING: %s is missing or empty; the level starts over\n", filename);
+	else
+	{
+		wasm_buffers_t *buffers = wasm_buffers();
+
+		// a delta is put back together for the game first
+		char level_path[sizeof(save_directory) + 16];
+		snprintf(level_path, sizeof(level_path), "%s/wasm_level.tmp", save_directory);
+
+		const bool expanded = q2_wasm_expand_level_delta(filename, level_path);
+		
+		NormalizeSavePath(expanded ? level_path : filename, buffers->filename, sizeof(buffers->filename));
+
+		uint32_t args[] = {
+			WASM_BUFFERS_OFFSET(filename)
+		};
+
+		wasm_call_args(wasm.WASM_ReadLevel, args, lengthof(args));
+
+		if (expanded)
+			remove(level_path);
+
+		post_sync_entities();
+	}
+
+	if (sys_wasmsavetimes->value)
+		q2_wasm_report_save_time("ReadLevel", start);
 }
 
 /*
@@ -3,8 +3,11 @@
 // This file contains structures that are being eaten natively from the
 // WASM sandbox, and functions to handle WASM data.
 
+#include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include "game/g_api.h"
+#include "game/g_wasm_ext.h"
 #include "shared/entity.h"
 #include "shared/client.h"
 #include <wasm_export.h>
@@ -45,8 +48,6 @@ typedef struct
 		char		filename[MAX_INFO_STRING];
 	};
 	wasm_trace_t	trace;
-	char			cmds[16][MAX_INFO_STRING / 8];
-	char			scmd[MAX_INFO_STRING];
 	csurface_t		nullsurf;
 } wasm_buffers_t;
 
@@ -67,16 +68,35 @@ typedef struct
 	wasm_module_inst_t module_inst;
 	wasm_exec_env_t exec_env;
 	uint8_t *assembly;
+	uint32_t assembly_size;
+	bool assembly_mapped;
 	char error_buf[128];
 
+	// linear memory; see wasm_sync_memory
+	wasm_memory_inst_t memory;
+	uint8_t *memory_base;
+	uint64_t memory_size, memory_pages;
+
 	int32_t edict_size, max_edicts;
 	wasm_addr_t edicts, num_edicts, edict_end;
 
+	// ceil(2^32 / edict_size), to divide by edict_size with a multiply
+	uint64_t edict_size_recip;
+
 	int32_t g_features;
 
+	// skip the bridge's checks that can't affect memory safety; see WASM_CHECK
+	bool trusted;
+
+	// per-frame exports are called straight into AoT code; see g_wasm_aot.c
+	bool aot_direct;
+
 	// address of type wasm_buffers_t
 	wasm_surface_address_t	buffers_addr;
 
+	// address of type wasm_defer_queue_t, or 0 if deferral is off
+	wasm_addr_t	defer_queue;
+
 	csurface_t	*nullsurf_native;
 
 	// Function pointers from WASM that we store.
@@ -88,35 +108,130 @@ typedef struct
 
 extern wasm_env_t wasm;
 
+// maxclients, latched at load
+extern int32_t max_clients;
+
+// Linear memory only moves or changes size when it grows, so its base and
+// size are cached and translation is plain arithmetic on them. The module
+// can grow memory any time it runs, so this is called at the start of
+// every import that touches memory, after every export call, and after
+// the bridge allocates from the module's heap; it only looks anything
+// else up when the page count has changed.
+void q2_wasm_memory_grown(void);
+
+static inline void wasm_sync_memory(void)
+{
+	const uint64_t pages = wasm_memory_get_cur_page_count(wasm.memory);
+
+	if (pages == wasm.memory_pages)
+		return;
+
+	wasm.memory_pages = pages;
+	wasm.memory_base = (uint8_t *) wasm_memory_get_base_address(wasm.memory);
+	wasm.memory_size = pages * wasm_memory_get_bytes_per_page(wasm.memory);
+
+	q2_wasm_memory_grown();
+}
+
+// picks up the memory of a freshly instantiated module
+static inline void wasm_reset_memory(void)
+{
+	wasm.memory = wasm_runtime_get_default_memory(wasm.module_inst);
+	wasm.memory_pages = UINT64_MAX;
+	wasm_sync_memory();
+}
+
 // convenience functions
 static inline void *wasm_addr_to_native(wasm_addr_t address)
 {
-	return wasm_runtime_addr_app_to_native(wasm.module_inst, address);
+	return address < wasm.memory_size ? wasm.memory_base + address : NULL;
 }
 
 static inline void *wasm_pointer_to_native(wasm_app_pointer_t address)
 {
-	return wasm_runtime_addr_app_to_native(wasm.module_inst, (uint32_t) address);
+	return wasm_addr_to_native((wasm_addr_t) (uintptr_t) address);
 }
 
 static inline wasm_addr_t wasm_native_to_addr(void *native)
 {
-	return (wasm_addr_t)wasm_runtime_addr_native_to_app(wasm.module_inst, native);
+	const uintptr_t offset = (uintptr_t) native - (uintptr_t) wasm.memory_base;
+	return offset < wasm.memory_size ? (wasm_addr_t) offset : 0;
 }
 
 static inline wasm_app_pointer_t wasm_native_to_pointer(void *native)
 {
-	return (wasm_app_pointer_t)wasm_runtime_addr_native_to_app(wasm.module_inst, native);
+	return (wasm_app_pointer_t) (uintptr_t) wasm_native_to_addr(native);
 }
 
 static inline bool wasm_validate_addr(uint32_t addr, uint32_t size)
 {
-	return wasm_runtime_validate_app_addr(wasm.module_inst, addr, size);
+	return (uint64_t) addr + size <= wasm.memory_size;
 }
 
 static inline bool wasm_validate_ptr(const void *ptr, uint32_t size)
 {
-	return wasm_runtime_validate_native_addr(wasm.module_inst, (void *) ptr, size);
+	const uintptr_t offset = (uintptr_t) ptr - (uintptr_t) wasm.memory_base;
+	return offset <= wasm.memory_size && (uint64_t) offset + size <= wasm.memory_size;
+}
+
+// Checks on pointers the bridge was handed that only catch a module using
+// the API wrong, like an edict pointer into the middle of an edict, and
+// not one pointing anywhere the bridge can't safely go; range and extent
+// checks are always made. A trusted module skips these; debug builds
+// still run them and report any a trusted module would have got past.
+#if defined(_DEBUG) || defined(WASM_CHECK_TRUSTED)
+static inline bool wasm_cross_check(bool passed, const char *check)
+{
+	if (!passed && wasm.trusted)
+		gi.dprintf("Trusted game module failed %s\n", check);
+
+	return passed;
+}
+
+#define WASM_CHECK(check) \
+	wasm_cross_check((check), #check)
+#else
+#define WASM_CHECK(check) \
+	(wasm.trusted || (check))
+#endif
+
+// allocates from the module's heap, which may grow memory
+static inline wasm_addr_t wasm_module_malloc(uint32_t size, void **native)
+{
+	const wasm_addr_t addr = (wasm_addr_t) wasm_runtime_module_malloc(wasm.module_inst, size, native);
+	wasm_sync_memory();
+	return addr;
+}
+
+// Raw natives get their arguments as the 64-bit slots they were passed
+// in, with pointers left as plain offsets. Those are checked against the
+// size of linear memory once and added to its base, instead of being
+// translated and checked by WAMR on the way in and again by us.
+#define WASM_RAW_I32(args, i) \
+	(*(int32_t *) &(args)[i])
+#define WASM_RAW_U32(args, i) \
+	(*(uint32_t *) &(args)[i])
+#define WASM_RAW_F32(args, i) \
+	(*(vec_t *) &(args)[i])
+
+typedef struct
+{
+	uint8_t		*base;
+	uint64_t	size;
+} wasm_raw_memory_t;
+
+// syncs memory, so raw natives call this first
+static inline wasm_raw_memory_t wasm_raw_memory(void)
+{
+	wasm_sync_memory();
+
+	return (wasm_raw_memory_t) { wasm.memory_base, wasm.memory_size };
+}
+
+// NULL for 0 or anything that doesn't fit in linear memory
+static inline void *wasm_raw_ptr(const wasm_raw_memory_t *memory, wasm_addr_t addr, uint64_t size)
+{
+	return (addr && (uint64_t) addr + size <= memory->size) ? memory->base + addr : NULL;
 }
 
 // convenient function to fetch typed buffer data
@@ -144,6 +259,8 @@ static inline wasm_string_t wasm_dup_str(const char *str)
 {
 	wasm_string_t s = wasm_runtime_module_dup_data(wasm.module_inst, str, strlen(str) + 1);
 
+	wasm_sync_memory();
+
 	if (!s)
 		wasm_error("Out of WASM memory");
 
@@ -223,9 +340,10 @@ static inline wasm_entity_address_t entity_number_to_wa(int32_t number)
 	return wasm.edicts + (number * wasm.edict_size);
 }
 
+// exact for anything that is a multiple of edict_size from the base
 static inline int32_t entity_wa_to_number(wasm_entity_address_t edict_offset)
 {
-	return (edict_offset - wasm.edicts) / wasm.edict_size;
+	return (int32_t) (((uint64_t) (edict_offset - wasm.edicts) * wasm.edict_size_recip) >> 32);
 }
 
 static inline wasm_entity_address_t entity_wnp_to_wa(wasm_edict_t *wasm_edict)
@@ -243,9 +361,10 @@ inline wasm_edict_t *entity_wa_to_wnp(wasm_entity_address_t e)
 	return (wasm_edict_t *) wasm_addr_to_native(e);
 }
 
+// the whole edict range was checked to be in memory when it was fetched
 static inline wasm_edict_t *entity_number_to_wnp(int32_t number)
 {
-	return entity_wa_to_wnp(entity_number_to_wa(number));
+	return (wasm_edict_t *) (wasm.memory_base + entity_number_to_wa(number));
 }
 
 static inline wasm_entity_address_t entity_np_to_wa(edict_t *e)
@@ -263,10 +382,19 @@ inline edict_t *entity_wa_to_np(wasm_entity_address_t e)
 	return e ? entity_number_to_np(entity_wa_to_number(e)) : NULL;
 }
 
+// Anything that passes the range check has a whole edict's worth of the
+// edict array at it, so even one in between edicts can't take the bridge
+// outside of memory or past the native edicts; landing on one exactly is
+// left to WASM_CHECK.
+static inline bool entity_validate_wa(wasm_entity_address_t addr)
+{
+	return addr == 0 || (addr >= wasm.edicts && addr - wasm.edicts <= wasm.edict_end - wasm.edicts - wasm.edict_size &&
+		WASM_CHECK((uint32_t) entity_wa_to_number(addr) * wasm.edict_size == addr - wasm.edicts));
+}
+
 static inline bool entity_validate_wnp(wasm_edict_t *e)
 {
-	wasm_addr_t addr = wasm_native_to_addr(e);
-	return addr == 0 || (addr >= wasm.edicts && addr < wasm.edict_end && (wasm_native_to_addr(e) - wasm.edicts) % wasm.edict_size == 0);
+	return entity_validate_wa(wasm_native_to_addr(e));
 }
 
 static inline void copy_link_wasm_to_native(edict_t *native_edict, const wasm_edict_t *wasm_edict)
@@ -375,37 +503,8 @@ typedef struct
 	int32_t				clientNum;
 } wasm_gclient_t;
 
-#ifdef KMQUAKE2_ENGINE_MOD
-static inline void sync_pmove_state_wasm_to_native(pmove_state_t *state, const wasm_pmove_state_t *wasm_state)
-{
-	for (int32_t i = 0; i < 3; i++)
-	{
-		state->delta_angles[i] = wasm_state->delta_angles[i];
-		state->origin[i] = wasm_state->origin[i];
-		state->velocity[i] = wasm_state->velocity[i];
-	}
-	state->gravity = wasm_state->gravity;
-	state->pm_flags = wasm_state->pm_flags;
-	state->pm_time = wasm_state->pm_time;
-	state->pm_type = wasm_state->pm_type;
-}
-
-static inline void sync_pmove_state_native_to_wasm(wasm_pmove_state_t *wasm_state, const pmove_state_t *state)
-{
-	for (int32_t i = 0; i < 3; i++)
-	{
-		wasm_state->delta_angles[i] = state->delta_angles[i];
-		wasm_state->origin[i] = (int16_t) state->origin[i];
-		wasm_state->velocity[i] = state->velocity[i];
-	}
-	wasm_state->gravity = state->gravity;
-	wasm_state->pm_flags = state->pm_flags;
-	wasm_state->pm_time = state->pm_time;
-	wasm_state->pm_type = state->pm_type;
-}
-
-extern bool stat_offsets[MAX_STATS];
-
+// configstring layout; the non-vanilla sizes
+// are remapped to on engines that support them.
 enum
 {
 	CS_NAME,
@@ -426,9 +525,15 @@ enum
 	MAX_VANILLA_SOUNDS = 256,
 	MAX_VANILLA_IMAGES = 256,
 
+#ifdef KMQUAKE2_ENGINE_MOD
 	MAX_MODELS = 8192,
 	MAX_SOUNDS = 8192,
 	MAX_IMAGES = 2048,
+#else
+	MAX_MODELS = MAX_VANILLA_MODELS,
+	MAX_SOUNDS = MAX_VANILLA_SOUNDS,
+	MAX_IMAGES = MAX_VANILLA_IMAGES,
+#endif
 
 	MAX_ITEMS = 256,
 	MAX_GENERAL = (MAX_CLIENTS * 2),
@@ -450,22 +555,48 @@ enum
 	MAX_VANILLA_CONFIGSTRINGS	= CS_VANILLA_GENERAL + MAX_GENERAL
 };
 
+#ifdef KMQUAKE2_ENGINE_MOD
+static inline void sync_pmove_state_wasm_to_native(pmove_state_t *state, const wasm_pmove_state_t *wasm_state)
+{
+	for (int32_t i = 0; i < 3; i++)
+	{
+		state->delta_angles[i] = wasm_state->delta_angles[i];
+		state->origin[i] = wasm_state->origin[i];
+		state->velocity[i] = wasm_state->velocity[i];
+	}
+	state->gravity = wasm_state->gravity;
+	state->pm_flags = wasm_state->pm_flags;
+	state->pm_time = wasm_state->pm_time;
+	state->pm_type = wasm_state->pm_type;
+}
+
+static inline void sync_pmove_state_native_to_wasm(wasm_pmove_state_t *wasm_state, const pmove_state_t *state)
+{
+	for (int32_t i = 0; i < 3; i++)
+	{
+		wasm_state->delta_angles[i] = state->delta_angles[i];
+		wasm_state->origin[i] = (int16_t) state->origin[i];
+		wasm_state->velocity[i] = state->velocity[i];
+	}
+	wasm_state->gravity = state->gravity;
+	wasm_state->pm_flags = state->pm_flags;
+	wasm_state->pm_time = state->pm_time;
+	wasm_state->pm_type = state->pm_type;
+}
+
+// vanilla -> native configstring, built once at init
+extern uint16_t configstring_remap[MAX_VANILLA_CONFIGSTRINGS];
+
+// stats that the current statusbar uses as configstring indices
+extern uint8_t remap_stats[MAX_VANILLA_STATS];
+extern int32_t num_remap_stats;
+
 static inline uint16_t wasm_remap_configstring(uint16_t id)
 {
-	if (id >= CS_VANILLA_GENERAL)
-		id = (id - CS_VANILLA_GENERAL) + CS_GENERAL;
-	else if (id >= CS_VANILLA_PLAYERSKINS)
-		id = (id - CS_VANILLA_PLAYERSKINS) + CS_PLAYERSKINS;
-	else if (id >= CS_VANILLA_ITEMS)
-		id = (id - CS_VANILLA_ITEMS) + CS_ITEMS;
-	else if (id >= CS_VANILLA_LIGHTS)
-		id = (id - CS_VANILLA_LIGHTS) + CS_LIGHTS;
-	else if (id >= CS_VANILLA_IMAGES)
-		id = (id - CS_VANILLA_IMAGES) + CS_IMAGES;
-	else if (id >= CS_VANILLA_SOUNDS)
-		id = (id - CS_VANILLA_SOUNDS) + CS_SOUNDS;
+	if (id < MAX_VANILLA_CONFIGSTRINGS)
+		return configstring_remap[id];
 
-	return id;
+	return (id - CS_VANILLA_GENERAL) + CS_GENERAL;
 }
 
 #else
@@ -509,12 +640,9 @@ static inline void sync_entity(wasm_edict_t *wasm_edict, edict_t *native, bool f
 		sync_pmove_state_wasm_to_native(&client->ps.pmove, &wasm_client->ps.pmove);
 		client->ps.rdflags = wasm_client->ps.rdflags;
 		for (int32_t i = 0; i < MAX_VANILLA_STATS; i++)
-		{
-			if (stat_offsets[i])
-				client->ps.stats[i] = wasm_remap_configstring(wasm_client->ps.stats[i]);
-			else
-				client->ps.stats[i] = wasm_client->ps.stats[i];
-		}
+			client->ps.stats[i] = wasm_client->ps.stats[i];
+		for (int32_t i = 0; i < num_remap_stats; i++)
+			client->ps.stats[remap_stats[i]] = wasm_remap_configstring(wasm_client->ps.stats[remap_stats[i]]);
 		client->ps.viewangles = wasm_client->ps.viewangles;
 		client->ps.viewoffset = wasm_client->ps.viewoffset;
 		client->ping = wasm_client->ping;
@@ -543,9 +671,121 @@ static inline void sync_entity(wasm_edict_t *wasm_edict, edict_t *native, bool f
 typedef wasm_addr_t wasm_function_pointer_t;
 
 void q2_wasm_clear_surface_cache(void);
+void q2_wasm_clear_index_cache(void);
+void q2_wasm_clear_configstrings(void);
+#ifdef KMQUAKE2_ENGINE_MOD
+void q2_wasm_init_configstring_remap(void);
+#endif
 void q2_wasm_update_cvars();
+void q2_wasm_reset_args(void);
+void q2_wasm_init_deferred(bool enabled);
+void q2_wasm_drain_deferred(void);
+void q2_wasm_end_frame(void);
+void q2_wasm_print_stats(void);
+void q2_wasm_report_save_time(const char *what, uint64_t start);
+bool q2_wasm_native_save_path(const char *path, char *native_path, size_t native_path_size);
+void q2_wasm_close_save_files(void);
+
+void q2_wasm_init_runtime_memory(RuntimeInitArgs *init_args, int32_t huge_pages, int32_t prefault);
+void q2_wasm_print_memory_stats(void);
+void q2_wasm_frame_bench(void);
+void q2_wasm_frame_begin(void);
+void q2_wasm_frame_end(void);
+void q2_wasm_shutdown_runtime_memory(void);
+
+void q2_wasm_module_digest(const uint8_t *data, uint32_t size, uint8_t digest[32]);
+bool q2_wasm_module_trusted(const char *base_directory, const uint8_t digest[32]);
+
+uint8_t *q2_wasm_load_module(const char *path, bool map, uint32_t *size);
+void q2_wasm_free_module(uint8_t *data, uint32_t size, bool mapped);
+void q2_wasm_init_aot_cache(const char *base_directory, const char *compiler, const char *profdata, bool collect_profile);
+const char *q2_wasm_aot_cache_path(void);
+void q2_wasm_aot_cache_used(void);
+bool q2_wasm_aot_exists(const char *path);
+bool q2_wasm_aot_is_stale(const char *path);
+int32_t q2_wasm_aot_cpu_level(void);
+void q2_wasm_aot_cache_update(bool native);
+void q2_wasm_aot_cache_shutdown(void);
+
+// the per-frame exports; these call AoT code directly when
+// wasm.aot_direct is set, and go through wasm_call_args otherwise
+bool q2_wasm_aot_direct_init(void);
+void q2_wasm_call_client_think(uint32_t ent, uint32_t ucmd);
+void q2_wasm_call_run_frame(void);
+void q2_wasm_call_pmove_trace(uint32_t pm, const vec3_t *start, const vec3_t *mins, const vec3_t *maxs, const vec3_t *end, uint32_t trace);
+int32_t q2_wasm_call_pmove_pointcontents(uint32_t pm, const vec3_t *point);
+bool q2_wasm_call_get_num_edicts_direct(int32_t *num_edicts);
+
+void q2_wasm_init_async_save(bool enabled, bool other_threads);
+void q2_wasm_join_save(bool wait);
+void q2_wasm_save_level_changed(void);
+void q2_wasm_save_end_frame(void);
+void q2_wasm_shutdown_async_save(void);
+bool q2_wasm_async_save(wasm_function_inst_t func, uint32_t *args, size_t num_args, const char *filename);
+
+// cursor over a whole-instance save image loaded into memory
+typedef struct
+{
+	const uint8_t	*data;
+	size_t			size, pos;
+} wasm_image_reader_t;
+
+static inline bool wasm_image_read(wasm_image_reader_t *r, void *dst, size_t len)
+{
+	if (r->size - r->pos < len)
+		return false;
+
+	memcpy(dst, r->data + r->pos, len);
+	r->pos += len;
+	return true;
+}
 
-int32_t RegisterApiNatives(void);
+void q2_wasm_init_image_saves(bool enabled, uint32_t heap_size);
+bool q2_wasm_image_saves_enabled(void);
+void q2_wasm_write_image(const char *filename);
+bool q2_wasm_read_game_image(const char *filename);
+bool q2_wasm_read_level_image(const char *filename);
+void q2_wasm_image_level_written(const char *filename);
+void q2_wasm_image_level_changed(void);
+void q2_wasm_image_end_frame(void);
+void q2_wasm_write_image_tables(FILE *fp);
+bool q2_wasm_read_image_tables(wasm_image_reader_t *r);
+
+void q2_wasm_init_level_deltas(bool enabled);
+bool q2_wasm_level_deltas_enabled(void);
+void q2_wasm_capture_level_base(const char *path);
+void q2_wasm_write_level_delta(const char *filename, bool async);
+bool q2_wasm_expand_level_delta(const char *filename, const char *out_path);
+
+typedef struct wasm_ram_file_s wasm_ram_file_t;
+
+void q2_wasm_init_ram_saves(bool enabled);
+void q2_wasm_ram_autosave(bool autosave);
+void q2_wasm_flush_ram_saves(void);
+void q2_wasm_commit_ram_saves(void);
+void q2_wasm_ram_mirror_autosave(const char *filename);
+bool q2_wasm_save_missing(const char *path);
+void q2_wasm_shutdown_ram_saves(void);
+wasm_ram_file_t *q2_wasm_ram_open(const char *path, bool write);
+uint32_t q2_wasm_ram_write(wasm_ram_file_t *file, const void *data, uint32_t size);
+uint32_t q2_wasm_ram_read(wasm_ram_file_t *file, void *data, uint32_t size);
+void q2_wasm_ram_close(wasm_ram_file_t *file);
+
+// Pool for small bridge-owned objects in WASM memory. size is rounded up
+// to the capacity of the block that was allocated.
+wasm_addr_t wasm_pool_alloc(uint32_t *size, void **native);
+void wasm_pool_free(wasm_addr_t addr, uint32_t size);
+wasm_string_t wasm_pool_dup_str(const char *str, uint32_t *size);
+
+// reserves size bytes in the staging region, discarding what was
+// staged before; dup_str then copies strings into it one after another.
+void wasm_staging_begin(uint32_t size);
+wasm_string_t wasm_staging_dup_str(const char *str);
+void wasm_pool_write_image(FILE *fp);
+bool wasm_pool_read_image(wasm_image_reader_t *r);
+void wasm_pool_shutdown(void);
+
+int32_t RegisterApiNatives(bool raw_hot_imports, bool time_hot_imports);
 
 static inline uint32_t wasm_call_args(wasm_function_inst_t func, uint32_t *args, size_t num_args)
 {
@@ -554,6 +794,8 @@ static inline uint32_t wasm_call_args(wasm_function_inst_t func, uint32_t *args,
 	else if (!wasm_runtime_call_wasm(wasm.exec_env, func, num_args, args))
 		wasm_error(wasm_runtime_get_exception(wasm.module_inst));
 
+	wasm_sync_memory();
+
 	if (args)
 		return args[0];
 
@@ -565,6 +807,20 @@ static inline void wasm_call(wasm_function_inst_t func)
 	wasm_call_args(func, NULL, 0);
 }
 
+// for timing things the bridge reports on
+static inline uint64_t wasm_time_nsec(void)
+{
+	struct timespec ts;
+
+#ifdef _WIN32
+	timespec_get(&ts, TIME_UTC);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
 static inline uint32_t ftoui32(float v)
 {
 	return *(uint32_t *) (&v);
@@ -0,0 +1,860 @@
+/*
+Copyright (C) 1997-2001 Id Software, Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "g_main.h"
+#include "g_wasm.h"
+
+#if WASM_AOT_DIRECT_CALLS
+#include "aot_runtime.h"
+#include "wasm_exec_env.h"
+#include "wasm_runtime_common.h"
+#endif
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <direct.h>
+#include <intrin.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+#endif
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define AOT_ARCH "x86_64"
+#elif defined(_M_IX86) || defined(__i386__)
+#define AOT_ARCH "i386"
+#elif defined(_M_ARM64) || defined(__aarch64__)
+#define AOT_ARCH "aarch64"
+#else
+#define AOT_ARCH "unknown"
+#endif
+
+// AoT modules are mapped instead of read into a buffer, which saves the
+// read and the heap copy of the file: pages are only read as the loader
+// touches them, and ones it doesn't write to stay clean page cache that
+// the kernel can drop. The code itself isn't shared between servers,
+// though; WAMR's loader copies the text section into executable memory
+// of its own, and only runs a module in place if wamrc built it with
+// --xip, which costs speed (no LLVM intrinsics, calls made indirectly)
+// and isn't what the AoT cache builds. The mapping is copy-on-write, but
+// pages that haven't been written to still track the file, so a game.aot
+// has to be replaced by renaming a new file over it (as the AoT cache
+// does), never by writing into it while a server runs. Bytecode is read
+// into a buffer as before; WAMR patches it in place while loading.
+static uint8_t *module_map(const char *path, uint32_t *size)
+{
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		gi.dprintf("Couldn't load %s: couldn't open it (error %lu)\n", path, GetLastError());
+		return NULL;
+	}
+
+	LARGE_INTEGER file_size;
+
+	if (!GetFileSizeEx(file, &file_size) || !file_size.QuadPart || file_size.QuadPart > UINT32_MAX)
+	{
+		CloseHandle(file);
+		gi.dprintf("Couldn't load %s: file is empty or too large\n", path);
+		return NULL;
+	}
+
+	// the view keeps the file and mapping alive by itself
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+	CloseHandle(file);
+
+	uint8_t *data = mapping ? (uint8_t *) MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0) : NULL;
+
+	if (mapping)
+		CloseHandle(mapping);
+
+	if (!data)
+	{
+		gi.dprintf("Couldn't load %s: couldn't map it (error %lu)\n", path, GetLastError());
+		return NULL;
+	}
+
+	*size = (uint32_t) file_size.QuadPart;
+	return data;
+#else
+	const int fd = open(path, O_RDONLY);
+
+	if (fd < 0)
+	{
+		gi.dprintf("Couldn't load %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	struct stat st;
+
+	if (fstat(fd, &st) != 0 || !st.st_size || (uint64_t) st.st_size > UINT32_MAX)
+	{
+		close(fd);
+		gi.dprintf("Couldn't load %s: file is empty or too large\n", path);
+		return NULL;
+	}
+
+	void *data = mmap(NULL, (size_t) st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (data == MAP_FAILED)
+	{
+		gi.dprintf("Couldn't load %s: couldn't map it: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	*size = (uint32_t) st.st_size;
+	return (uint8_t *) data;
+#endif
+}
+
+static uint8_t *module_read(const char *path, uint32_t *size)
+{
+	FILE *fp = fopen(path, "rb");
+
+	if (!fp)
+	{
+		gi.dprintf("Couldn't load %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	fseek(fp, 0, SEEK_END);
+	const long length = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	if (length <= 0 || (uint64_t) length > UINT32_MAX)
+	{
+		fclose(fp);
+		gi.dprintf("Couldn't load %s: file is empty or too large\n", path);
+		return NULL;
+	}
+
+	uint8_t *data = (uint8_t *) gi.TagMalloc((int32_t) length, TAG_GAME);
+	const bool read = fread(data, 1, (size_t) length, fp) == (size_t) length;
+
+	fclose(fp);
+
+	if (!read)
+	{
+		gi.TagFree(data);
+		gi.dprintf("Couldn't load %s: read error\n", path);
+		return NULL;
+	}
+
+	*size = (uint32_t) length;
+	return data;
+}
+
+// map is for AoT modules; prints why if the file can't be had
+uint8_t *q2_wasm_load_module(const char *path, bool map, uint32_t *size)
+{
+	return map ? module_map(path, size) : module_read(path, size);
+}
+
+void q2_wasm_free_module(uint8_t *data, uint32_t size, bool mapped)
+{
+	if (!mapped)
+	{
+		gi.TagFree(data);
+		return;
+	}
+
+#ifdef _WIN32
+	UnmapViewOfFile(data);
+#else
+	munmap(data, size);
+#endif
+}
+
+// AoT cache. wamrc compiles for the CPU it runs on, so a game.aot is only
+// good for the game.wasm, CPU and WAMR version it was made with. Those
+// make up the name of its file under aotcache/, and when there's no file
+// for them yet, the compiler is run in the background to make one for the
+// next start. The compiler writes to a temporary file that's only renamed
+// into place once it's done, so a half-written module is never picked up.
+//
+// With sys_wasmpgo 1, the cache also builds a module instrumented with
+// LLVM's PGO counters. Running that records call counts and branch and
+// block hotness, which are dumped at shutdown and handed to wamrc once
+// more (through llvm-profdata) to make a profile-optimised module. That
+// one is preferred over the others from then on, whether sys_wasmpgo is
+// still set or not; delete it to record a new profile. Dumping the
+// counters needs a WAMR built with WAMR_BUILD_AOT_PGO, and the bridge
+// built with WASM_ENABLE_AOT_PGO 1 to match.
+typedef enum
+{
+	AOT_PROFILED,
+	AOT_PLAIN,
+	AOT_INSTRUMENTED,
+
+	AOT_NUM_VARIANTS
+} aot_variant_t;
+
+static const char *const aot_variant_suffix[AOT_NUM_VARIANTS] = { "-pgo", "", "-instr" };
+
+static struct
+{
+	bool			have_wasm;
+	bool			collect_profile;
+	time_t			wasm_mtime;
+	char			wasm_path[MAX_INFO_STRING];
+	char			cache_dir[MAX_INFO_STRING];
+	char			cache_key[MAX_INFO_STRING];	// path without variant or extension
+	char			paths[AOT_NUM_VARIANTS][MAX_INFO_STRING];
+	char			compiler[MAX_INFO_STRING];
+	char			profdata[MAX_INFO_STRING];
+
+	aot_variant_t	selected, used;
+	bool			in_use;
+} aot_cache;
+
+static uint64_t aot_hash(uint64_t hash, const void *data, size_t size)
+{
+	const uint8_t *p = (const uint8_t *) data;
+
+	for (size_t i = 0; i < size; i++)
+		hash = (hash ^ p[i]) * 1099511628211ull;
+
+	return hash;
+}
+
+// zeroes for leaves the CPU doesn't have
+static void aot_cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4])
+{
+	regs[0] = regs[1] = regs[2] = regs[3] = 0;
+
+#if defined(_WIN32) && (defined(_M_X64) || defined(_M_IX86))
+	int max[4];
+	__cpuid(max, (int) (leaf & 0x80000000u));
+
+	if ((uint32_t) max[0] >= leaf)
+		__cpuidex((int *) regs, (int) leaf, (int) subleaf);
+#elif defined(__x86_64__) || defined(__i386__)
+	__get_cpuid_count(leaf, subleaf, &regs[0], &regs[1], &regs[2], &regs[3]);
+#endif
+}
+
+// register state the OS saves on context switches
+static uint64_t aot_xcr0(void)
+{
+#if defined(_WIN32) && (defined(_M_X64) || defined(_M_IX86))
+	return _xgetbv(0);
+#elif defined(__x86_64__) || defined(__i386__)
+	uint32_t lo, hi;
+	__asm__ volatile ("xgetbv" : "=a" (lo), "=d" (hi) : "c" (0));
+	return ((uint64_t) hi << 32) | lo;
+#else
+	return 0;
+#endif
+}
+
+#define AOT_HAS(reg, bits) \
+	(((reg) & (bits)) == (bits))
+
+// The x86-64 microarchitecture level this CPU supports, as in the psABI:
+// 1 is baseline x86-64, 2 adds SSE4.2 and POPCNT, 3 adds AVX2, FMA and
+// BMI, 4 adds AVX-512. 0 for builds that aren't x86-64.
+int32_t q2_wasm_aot_cpu_level(void)
+{
+#if defined(_M_X64) || defined(__x86_64__)
+	uint32_t basic[4], ext[4], extended[4];
+
+	aot_cpuid(1, 0, basic);
+	aot_cpuid(7, 0, ext);
+	aot_cpuid(0x80000001u, 0, extended);
+
+	// SSE3, SSSE3, CX16, SSE4.1, SSE4.2, POPCNT; LAHF
+	if (!AOT_HAS(basic[2], (1u << 0) | (1u << 9) | (1u << 13) | (1u << 19) | (1u << 20) | (1u << 23)) ||
+		!AOT_HAS(extended[2], 1u << 0))
+		return 1;
+
+	// FMA, MOVBE, OSXSAVE, AVX, F16C; BMI1, AVX2, BMI2; LZCNT; YMM state
+	if (!AOT_HAS(basic[2], (1u << 12) | (1u << 22) | (1u << 27) | (1u << 28) | (1u << 29)) ||
+		!AOT_HAS(ext[1], (1u << 3) | (1u << 5) | (1u << 8)) ||
+		!AOT_HAS(extended[2], 1u << 5))
+		return 2;
+
+	const uint64_t xcr0 = aot_xcr0();
+
+	if (!AOT_HAS(xcr0, 0x6))
+		return 2;
+
+	// AVX512 F, DQ, CD, BW, VL; opmask and ZMM state
+	if (!AOT_HAS(ext[1], (1u << 16) | (1u << 17) | (1u << 28) | (1u << 30) | (1u << 31)) ||
+		!AOT_HAS(xcr0, 0xe6))
+		return 3;
+
+	return 4;
+#else
+	return 0;
+#endif
+}
+
+// what the CPU can do, as far as generated code is concerned
+static uint32_t aot_cpu_id(void)
+{
+	uint32_t regs[2][4];
+
+	aot_cpuid(1, 0, regs[0]);
+	aot_cpuid(7, 0, regs[1]);
+
+	// leaf 1 ebx is the APIC id and such, which differ between cores
+	regs[0][1] = 0;
+
+	return (uint32_t) aot_hash(14695981039346656037ull, regs, sizeof(regs));
+}
+
+bool q2_wasm_aot_exists(const char *path)
+{
+	FILE *fp = fopen(path, "rb");
+
+	if (!fp)
+		return false;
+
+	fclose(fp);
+	return true;
+}
+
+void q2_wasm_init_aot_cache(const char *base_directory, const char *compiler, const char *profdata, bool collect_profile)
+{
+	snprintf(aot_cache.wasm_path, sizeof(aot_cache.wasm_path), "%s/game.wasm", base_directory);
+	snprintf(aot_cache.cache_dir, sizeof(aot_cache.cache_dir), "%s/aotcache", base_directory);
+	snprintf(aot_cache.compiler, sizeof(aot_cache.compiler), "%s", compiler);
+	snprintf(aot_cache.profdata, sizeof(aot_cache.profdata), "%s", profdata);
+	aot_cache.collect_profile = collect_profile;
+
+#if !WASM_ENABLE_AOT_PGO
+	if (collect_profile)
+	{
+		gi.dprintf("sys_wasmpgo needs a WAMR built with AoT PGO support; ignored\n");
+		aot_cache.collect_profile = false;
+	}
+#endif
+
+	FILE *fp = fopen(aot_cache.wasm_path, "rb");
+
+	if (!(aot_cache.have_wasm = fp != NULL))
+		return;
+
+	uint64_t hash = 14695981039346656037ull;
+	uint8_t buffer[65536];
+	size_t read;
+
+	while ((read = fread(buffer, 1, sizeof(buffer), fp)) != 0)
+		hash = aot_hash(hash, buffer, read);
+
+	fclose(fp);
+
+	struct stat st;
+
+	aot_cache.wasm_mtime = stat(aot_cache.wasm_path, &st) == 0 ? st.st_mtime : 0;
+
+	uint32_t major, minor, patch;
+	wasm_runtime_get_version(&major, &minor, &patch);
+
+	snprintf(aot_cache.cache_key, sizeof(aot_cache.cache_key), "%s/game-%016llx-%s-%08x-%u.%u.%u",
+		aot_cache.cache_dir, (unsigned long long) hash, AOT_ARCH, aot_cpu_id(), major, minor, patch);
+
+	for (int32_t i = 0; i < AOT_NUM_VARIANTS; i++)
+		snprintf(aot_cache.paths[i], sizeof(aot_cache.paths[i]), "%s%s.aot", aot_cache.cache_key, aot_variant_suffix[i]);
+}
+
+// the best cached module there is for game.wasm, if any; while
+// collecting a profile that hasn't been made into a module
+// yet, the instrumented one comes before the plain one
+const char *q2_wasm_aot_cache_path(void)
+{
+	if (!aot_cache.have_wasm)
+		return NULL;
+
+	if (q2_wasm_aot_exists(aot_cache.paths[AOT_PROFILED]))
+		aot_cache.selected = AOT_PROFILED;
+	else if (aot_cache.collect_profile && q2_wasm_aot_exists(aot_cache.paths[AOT_INSTRUMENTED]))
+		aot_cache.selected = AOT_INSTRUMENTED;
+	else if (q2_wasm_aot_exists(aot_cache.paths[AOT_PLAIN]))
+		aot_cache.selected = AOT_PLAIN;
+	else
+		return NULL;
+
+	return aot_cache.paths[aot_cache.selected];
+}
+
+// the module from q2_wasm_aot_cache_path was loaded
+void q2_wasm_aot_cache_used(void)
+{
+	aot_cache.used = aot_cache.selected;
+	aot_cache.in_use = true;
+}
+
+// a game.aot that's older than the game.wasm next
+// to it was most likely made from an older build
+bool q2_wasm_aot_is_stale(const char *path)
+{
+	struct stat st;
+
+	return aot_cache.have_wasm && stat(path, &st) == 0 && st.st_mtime < aot_cache.wasm_mtime;
+}
+
+#ifdef _WIN32
+static void aot_append_command(char *command, size_t size, const char *const *argv)
+{
+	size_t length = strlen(command);
+
+	for (; *argv && length < size; argv++)
+		length += snprintf(command + length, size - length, "\"%s\" ", *argv);
+
+	if (length < size)
+		snprintf(command + length, size - length, ">nul 2>&1 && ");
+}
+#endif
+
+// Runs each command in turn in a process of its own that the server
+// doesn't wait on, and if they all succeed, moves temp_path to path.
+static void aot_run_background(const char *const *commands[], int32_t num_commands, const char *temp_path, const char *path)
+{
+#ifdef _WIN32
+	_mkdir(aot_cache.cache_dir);
+
+	char command[MAX_INFO_STRING * 12] = "";
+
+	for (int32_t i = 0; i < num_commands; i++)
+		aot_append_command(command, sizeof(command), commands[i]);
+
+	char shell[sizeof(command) + MAX_INFO_STRING * 2 + 64];
+	snprintf(shell, sizeof(shell), "cmd.exe /s /c \"%smove /y \"%s\" \"%s\" >nul\"", command, temp_path, path);
+
+	STARTUPINFOA si = { .cb = sizeof(si) };
+	PROCESS_INFORMATION pi;
+
+	if (!CreateProcessA(NULL, shell, NULL, NULL, FALSE, CREATE_NO_WINDOW | BELOW_NORMAL_PRIORITY_CLASS, NULL, NULL, &si, &pi))
+	{
+		gi.dprintf("Couldn't start %s to fill the AoT cache\n", commands[0][0]);
+		return;
+	}
+
+	CloseHandle(pi.hThread);
+	CloseHandle(pi.hProcess);
+#else
+	mkdir(aot_cache.cache_dir, 0755);
+
+	// the middle process exits right away so the server doesn't have to
+	// reap anything; the one left over waits for the commands to finish
+	const pid_t pid = fork();
+
+	if (pid < 0)
+	{
+		gi.dprintf("Couldn't start %s to fill the AoT cache\n", commands[0][0]);
+		return;
+	}
+
+	if (pid == 0)
+	{
+		if (fork() != 0)
+			_exit(0);
+
+		setsid();
+		setpriority(PRIO_PROCESS, 0, 10);
+
+		// nothing of the server's, like its sockets, should stay open in
+		// here or in the commands, which can outlive it
+		const int null_fd = open("/dev/null", O_RDWR);
+
+		if (null_fd >= 0)
+		{
+			dup2(null_fd, STDIN_FILENO);
+			dup2(null_fd, STDOUT_FILENO);
+			dup2(null_fd, STDERR_FILENO);
+		}
+
+		long max_fd = sysconf(_SC_OPEN_MAX);
+
+		if (max_fd < 0)
+			max_fd = 1024;
+
+		for (int fd = STDERR_FILENO + 1; fd < max_fd; fd++)
+			close(fd);
+
+		for (int32_t i = 0; i < num_commands; i++)
+		{
+			const pid_t child = fork();
+
+			if (child == 0)
+			{
+				execvp(commands[i][0], (char *const *) commands[i]);
+				_exit(127);
+			}
+
+			int status;
+
+			if (child < 0 || waitpid(child, &status, 0) != child || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			{
+				remove(temp_path);
+				_exit(0);
+			}
+		}
+
+		rename(temp_path, path);
+		_exit(0);
+	}
+
+	waitpid(pid, NULL, 0);
+#endif
+}
+
+// Another server sharing the cache may be building the same module,
+// so each one writes its own temporary file.
+static void aot_temp_path(aot_variant_t variant, char *temp_path, size_t temp_path_size)
+{
+#ifdef _WIN32
+	snprintf(temp_path, temp_path_size, "%s.%lu.tmp", aot_cache.paths[variant], (unsigned long) GetCurrentProcessId());
+#else
+	snprintf(temp_path, temp_path_size, "%s.%ld.tmp", aot_cache.paths[variant], (long) getpid());
+#endif
+}
+
+static void aot_compile(aot_variant_t variant)
+{
+	char temp_path[MAX_INFO_STRING];
+	aot_temp_path(variant, temp_path, sizeof(temp_path));
+
+	const char *const plain[] = { aot_cache.compiler, "-o", temp_path, aot_cache.wasm_path, NULL };
+	const char *const instrumented[] = { aot_cache.compiler, "--enable-llvm-pgo", "-o", temp_path, aot_cache.wasm_path, NULL };
+	const char *const *commands[] = { variant == AOT_INSTRUMENTED ? instrumented : plain };
+
+	aot_run_background(commands, lengthof(commands), temp_path, aot_cache.paths[variant]);
+}
+
+// Starts building whatever module the next start is going to want.
+// native is whether the game is running as native code already.
+void q2_wasm_aot_cache_update(bool native)
+{
+	if (!aot_cache.have_wasm || !aot_cache.compiler[0])
+		return;
+
+	if (aot_cache.collect_profile && !q2_wasm_aot_exists(aot_cache.paths[AOT_PROFILED]) &&
+		!q2_wasm_aot_exists(aot_cache.paths[AOT_INSTRUMENTED]))
+	{
+		aot_compile(AOT_INSTRUMENTED);
+		gi.dprintf("Compiling an instrumented game.wasm for sys_wasmpgo in the background\n");
+	}
+	else if (!native && !q2_wasm_aot_exists(aot_cache.paths[AOT_PLAIN]))
+	{
+		aot_compile(AOT_PLAIN);
+		gi.dprintf("Compiling game.wasm into the AoT cache in the background\n");
+	}
+}
+
+#if WASM_ENABLE_AOT_PGO
+// If the instrumented module ran, writes out what it recorded and
+// starts turning that into the profile-optimised module.
+void q2_wasm_aot_cache_shutdown(void)
+{
+	if (!aot_cache.in_use || aot_cache.used != AOT_INSTRUMENTED || !aot_cache.compiler[0] || !aot_cache.profdata[0])
+		return;
+
+	aot_cache.in_use = false;
+
+	const uint32_t size = wasm_runtime_get_pgo_prof_data_size(wasm.module_inst);
+
+	if (!size)
+		return;
+
+	char *data = (char *) gi.TagMalloc((int32_t) size, TAG_GAME);
+	const uint32_t written = wasm_runtime_dump_pgo_prof_data_to_buf(wasm.module_inst, data, size);
+
+	char raw_path[MAX_INFO_STRING], profile_path[MAX_INFO_STRING], temp_path[MAX_INFO_STRING];
+	snprintf(raw_path, sizeof(raw_path), "%s.profraw", aot_cache.cache_key);
+	snprintf(profile_path, sizeof(profile_path), "%s.profdata", aot_cache.cache_key);
+	aot_temp_path(AOT_PROFILED, temp_path, sizeof(temp_path));
+
+	FILE *fp = fopen(raw_path, "wb");
+	const bool saved = fp && fwrite(data, 1, written, fp) == written;
+
+	if (fp)
+		fclose(fp);
+
+	gi.TagFree(data);
+
+	if (!saved)
+	{
+		gi.dprintf("Couldn't write the PGO profile to %s\n", raw_path);
+		return;
+	}
+
+	char use_profile[MAX_INFO_STRING + 16];
+	snprintf(use_profile, sizeof(use_profile), "--use-prof-file=%s", profile_path);
+
+	const char *const merge[] = { aot_cache.profdata, "merge", "-o", profile_path, raw_path, NULL };
+	const char *const compile[] = { aot_cache.compiler, use_profile, "-o", temp_path, aot_cache.wasm_path, NULL };
+	const char *const *commands[] = { merge, compile };
+
+	aot_run_background(commands, lengthof(commands), temp_path, aot_cache.paths[AOT_PROFILED]);
+
+	gi.dprintf("Compiling a profile-optimised game.wasm in the background\n");
+}
+#else
+// the instrumented module is never picked without PGO support
+void q2_wasm_aot_cache_shutdown(void)
+{
+}
+#endif
+
+// Direct calls into AoT code for the exports called most every frame.
+// wasm_runtime_call_wasm checks the argument count against the function's
+// type, passes the arguments through a trampoline that reads each one's
+// type to place it, and copies results back into argv, on every call.
+// Here the native function pointers are taken out of WAMR once the module
+// loads and called with typed arguments, doing only the trap setup that
+// WAMR would: with hardware bounds checks, a bad access in the game jumps
+// back to the jmpbuf pushed here, so it still ends in an error rather than
+// a crash.
+//
+// This needs WAMR's internal headers (core/iwasm/aot, core/iwasm/common
+// and core/shared), built with the same WASM_ENABLE_* and
+// OS_ENABLE_HW_BOUND_CHECK defines as the runtime, so it's behind
+// WASM_AOT_DIRECT_CALLS. A WAMR built with call stack dumps or perf
+// profiling should leave it off, since only the regular call pushes the
+// frames those need. Bytecode modules always take the regular call.
+#if WASM_AOT_DIRECT_CALLS
+typedef void (*aot_client_think_t)(WASMExecEnv *exec_env, uint32_t ent, uint32_t ucmd);
+typedef void (*aot_run_frame_t)(WASMExecEnv *exec_env);
+typedef void (*aot_pmove_trace_t)(WASMExecEnv *exec_env, uint32_t pm, float start_x, float start_y, float start_z,
+	float mins_x, float mins_y, float mins_z, float maxs_x, float maxs_y, float maxs_z,
+	float end_x, float end_y, float end_z, uint32_t trace);
+typedef int32_t (*aot_pmove_pointcontents_t)(WASMExecEnv *exec_env, uint32_t pm, float x, float y, float z);
+typedef int32_t (*aot_get_num_edicts_t)(WASMExecEnv *exec_env);
+
+static struct
+{
+	aot_client_think_t			client_think;
+	aot_run_frame_t				run_frame;
+	aot_pmove_trace_t			pmove_trace;
+	aot_pmove_pointcontents_t	pmove_pointcontents;
+	aot_get_num_edicts_t		get_num_edicts;
+} aot_direct;
+
+static bool aot_direct_types_match(const wasm_valkind_t *types, uint32_t count, const char *wanted)
+{
+	if (count != strlen(wanted))
+		return false;
+
+	for (uint32_t i = 0; i < count; i++)
+		if (types[i] != (wanted[i] == 'f' ? WASM_F32 : WASM_I32))
+			return false;
+
+	return true;
+}
+
+// The export's native code, if its type is exactly params -> results
+// ('i' for i32, 'f' for f32); NULL means it takes the regular call.
+static void *aot_direct_resolve(wasm_function_inst_t func, const char *params, const char *results)
+{
+	if (!func)
+		return NULL;
+
+	const AOTFunctionInstance *aot_func = (const AOTFunctionInstance *) func;
+	wasm_valkind_t types[16];
+
+	if (aot_func->is_import_func)
+		return NULL;
+
+	const uint32_t num_params = wasm_func_get_param_count(func, wasm.module_inst);
+	const uint32_t num_results = wasm_func_get_result_count(func, wasm.module_inst);
+
+	if (num_params > lengthof(types) || num_results > lengthof(types))
+		return NULL;
+
+	wasm_func_get_param_types(func, wasm.module_inst, types);
+
+	if (!aot_direct_types_match(types, num_params, params))
+		return NULL;
+
+	wasm_func_get_result_types(func, wasm.module_inst, types);
+
+	if (!aot_direct_types_match(types, num_results, results))
+		return NULL;
+
+	return aot_func->u.func.func_ptr;
+}
+
+// Called once an AoT module is instantiated; false if direct
+// calls aren't possible and everything takes the regular call.
+bool q2_wasm_aot_direct_init(void)
+{
+	aot_direct.client_think = (aot_client_think_t) aot_direct_resolve(wasm.WASM_ClientThink, "ii", "");
+	aot_direct.run_frame = (aot_run_frame_t) aot_direct_resolve(wasm.WASM_RunFrame, "", "");
+	aot_direct.pmove_trace = (aot_pmove_trace_t) aot_direct_resolve(wasm.WASM_PmoveTrace, "iffffffffffffi", "");
+	aot_direct.pmove_pointcontents = (aot_pmove_pointcontents_t) aot_direct_resolve(wasm.WASM_PmovePointContents, "ifff", "i");
+	aot_direct.get_num_edicts = (aot_get_num_edicts_t) aot_direct_resolve(wasm.WASM_GetNumEdicts, "", "i");
+
+	// the regular call records the thread and its stack bounds on its
+	// first use; direct calls may come first, so do it here as well
+	wasm_exec_env_set_thread_info((WASMExecEnv *) wasm.exec_env);
+
+	return true;
+}
+
+static inline void aot_direct_finish(void)
+{
+	const char *exception = wasm_runtime_get_exception(wasm.module_inst);
+
+	if (exception)
+		wasm_error(exception);
+
+	wasm_sync_memory();
+}
+
+// the same trap setup invoke_native_with_hw_bound_check does; a nested
+// call (PmoveTrace from inside ClientThink) pushes its own jmpbuf
+#ifdef OS_ENABLE_HW_BOUND_CHECK
+#define AOT_DIRECT_CALL(call) \
+	do \
+	{ \
+		WASMExecEnv *exec_env = (WASMExecEnv *) wasm.exec_env; \
+		WASMExecEnv *prev_tls = wasm_runtime_get_exec_env_tls(); \
+		WASMJmpBuf jmpbuf_node = { 0 }; \
+		\
+		wasm_runtime_set_exec_env_tls(exec_env); \
+		wasm_exec_env_push_jmpbuf(exec_env, &jmpbuf_node); \
+		\
+		if (os_setjmp(jmpbuf_node.jmpbuf) == 0) \
+			call; \
+		\
+		wasm_exec_env_pop_jmpbuf(exec_env); \
+		wasm_runtime_set_exec_env_tls(prev_tls); \
+		aot_direct_finish(); \
+	} while (0)
+#else
+#define AOT_DIRECT_CALL(call) \
+	do \
+	{ \
+		WASMExecEnv *exec_env = (WASMExecEnv *) wasm.exec_env; \
+		call; \
+		aot_direct_finish(); \
+	} while (0)
+#endif
+#else
+bool q2_wasm_aot_direct_init(void)
+{
+	return false;
+}
+#endif
+
+void q2_wasm_call_client_think(uint32_t ent, uint32_t ucmd)
+{
+#if WASM_AOT_DIRECT_CALLS
+	if (wasm.aot_direct && aot_direct.client_think)
+	{
+		AOT_DIRECT_CALL(aot_direct.client_think(exec_env, ent, ucmd));
+		return;
+	}
+#endif
+
+	uint32_t args[] = { ent, ucmd };
+	wasm_call_args(wasm.WASM_ClientThink, args, lengthof(args));
+}
+
+void q2_wasm_call_run_frame(void)
+{
+#if WASM_AOT_DIRECT_CALLS
+	if (wasm.aot_direct && aot_direct.run_frame)
+	{
+		AOT_DIRECT_CALL(aot_direct.run_frame(exec_env));
+		return;
+	}
+#endif
+
+	wasm_call(wasm.WASM_RunFrame);
+}
+
+void q2_wasm_call_pmove_trace(uint32_t pm, const vec3_t *start, const vec3_t *mins, const vec3_t *maxs, const vec3_t *end, uint32_t trace)
+{
+#if WASM_AOT_DIRECT_CALLS
+	if (wasm.aot_direct && aot_direct.pmove_trace)
+	{
+		AOT_DIRECT_CALL(aot_direct.pmove_trace(exec_env, pm, start->x, start->y, start->z,
+			mins->x, mins->y, mins->z, maxs->x, maxs->y, maxs->z, end->x, end->y, end->z, trace));
+		return;
+	}
+#endif
+
+	uint32_t args[] = {
+		pm,
+		ftoui32(start->x), ftoui32(start->y), ftoui32(start->z),
+		ftoui32(mins->x), ftoui32(mins->y), ftoui32(mins->z),
+		ftoui32(maxs->x), ftoui32(maxs->y), ftoui32(maxs->z),
+		ftoui32(end->x), ftoui32(end->y), ftoui32(end->z),
+		trace
+	};
+
+	wasm_call_args(wasm.WASM_PmoveTrace, args, lengthof(args));
+}
+
+int32_t q2_wasm_call_pmove_pointcontents(uint32_t pm, const vec3_t *point)
+{
+#if WASM_AOT_DIRECT_CALLS
+	if (wasm.aot_direct && aot_direct.pmove_pointcontents)
+	{
+		volatile int32_t contents = 0;
+		AOT_DIRECT_CALL(contents = aot_direct.pmove_pointcontents(exec_env, pm, point->x, point->y, point->z));
+		return contents;
+	}
+#endif
+
+	uint32_t args[] = {
+		pm,
+		ftoui32(point->x), ftoui32(point->y), ftoui32(point->z)
+	};
+
+	wasm_call_args(wasm.WASM_PmovePointContents, args, lengthof(args));
+
+	return (int32_t) args[0];
+}
+
+// for sv wasm_bench; false if there's no direct call to time
+bool q2_wasm_call_get_num_edicts_direct(int32_t *num_edicts)
+{
+#if WASM_AOT_DIRECT_CALLS
+	if (wasm.aot_direct && aot_direct.get_num_edicts)
+	{
+		volatile int32_t num = 0;
+		AOT_DIRECT_CALL(num = aot_direct.get_num_edicts(exec_env));
+		*num_edicts = num;
+		return true;
+	}
+#endif
+
+	(void) num_edicts;
+	return false;
+}
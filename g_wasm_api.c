@@ -24,13 +24,13 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 
 #include <wasm_export.h>
 
-// Cvars are handled as heap copies given to the WASM runtime.
-// Every now and then, we check to see if we have to update the cvar.
+// Cvars are handled as copies in the bridge's string pool given to the WASM
+// runtime. Every now and then, we check to see if we have to update the cvar.
 typedef struct wasm_mapped_cvar_s
 {
 	cvar_t		*native;
 	wasm_addr_t	wasm_ptr;
-	size_t		string_size, latched_string_size;
+	uint32_t	string_size, latched_string_size;
 	struct wasm_mapped_cvar_s *next;
 } wasm_mapped_cvar_t;
 
@@ -45,13 +45,13 @@ static wasm_mapped_cvar_t *fetch_mapped_cvar(const char *name)
 	return NULL;
 }
 
-static void update_cvar_string(const char *src, size_t *dst_size, uint32_t *dst_ptr)
+static void update_cvar_string(const char *src, uint32_t *dst_size, uint32_t *dst_ptr)
 {
 	if (!*dst_ptr && !src)
 		return;
 	else if (*dst_ptr && !src)
 	{
-		wasm_runtime_module_free(wasm.module_inst, *dst_ptr);
+		wasm_pool_free(*dst_ptr, *dst_size);
 		*dst_ptr = 0;
 		*dst_size = 0;
 		return;
@@ -67,24 +67,22 @@ static void update_cvar_string(const char *src, size_t *dst_size, uint32_t *dst_
 			return;
 	}
 
-	const size_t length = strlen(src);
+	const uint32_t length = (uint32_t) strlen(src);
 
+	// the pool rounds sizes up to their size class, so
+	// most changes can be done in-place.
 	if (length + 1 > *dst_size)
 	{
-		if (*dst_ptr)
-			wasm_runtime_module_free(wasm.module_inst, *dst_ptr);
+		wasm_pool_free(*dst_ptr, *dst_size);
 		
 		*dst_size = length + 1;
-		*dst_ptr = wasm_runtime_module_malloc(wasm.module_inst, *dst_size, (void **) &dst);
-
-		if (!*dst_ptr)
-			wasm_error("Out of WASM memory");
+		*dst_ptr = wasm_pool_alloc(dst_size, (void **) &dst);
 	}
 
 	if (!dst)
 		wasm_error("Not sure how this happen");
 	else
-		memcpy(dst, src, *dst_size);
+		memcpy(dst, src, length + 1);
 }
 
 static void update_mapped_cvar(wasm_cvar_t *wasm_cvar, wasm_mapped_cvar_t *cvar, qboolean modified)
@@ -122,15 +120,14 @@ static wasm_cvar_t *map_cvar(cvar_t *native, wasm_mapped_cvar_t **mapped)
 	m->native = native;
 
 	wasm_cvar_t *wasm_cvar;
+	uint32_t size = sizeof(wasm_cvar_t);
 
-	m->wasm_ptr = wasm_runtime_module_malloc(wasm.module_inst, sizeof(wasm_cvar_t), (void **) &wasm_cvar);
-
-	if (!m->wasm_ptr)
-		wasm_error("Out of WASM memory");
+	m->wasm_ptr = wasm_pool_alloc(&size, (void **) &wasm_cvar);
 
 	memset(wasm_cvar, 0, sizeof(wasm_cvar_t));
 
-	wasm_cvar->name = wasm_dup_str(native->name);
+	// names never change, so we don't bother keeping the size around
+	wasm_cvar->name = wasm_pool_dup_str(native->name, &size);
 
 	mapped_cvars = m;
 
@@ -139,6 +136,8 @@ static wasm_cvar_t *map_cvar(cvar_t *native, wasm_mapped_cvar_t **mapped)
 
 static uint32_t q2_cvar(wasm_exec_env_t env, const char *name, const char *value, const int32_t flags)
 {
+	wasm_sync_memory();
+
 	wasm_mapped_cvar_t *mapped = fetch_mapped_cvar(name);
 	wasm_cvar_t *wasm_cvar;
 
@@ -154,6 +153,8 @@ static uint32_t q2_cvar(wasm_exec_env_t env, const char *name, const char *value
 
 static uint32_t q2_cvar_set(wasm_exec_env_t env, const char *name, const char *value)
 {
+	wasm_sync_memory();
+
 	wasm_mapped_cvar_t *mapped = fetch_mapped_cvar(name);
 	wasm_cvar_t *wasm_cvar;
 
@@ -169,6 +170,8 @@ static uint32_t q2_cvar_set(wasm_exec_env_t env, const char *name, const char *v
 
 static uint32_t q2_cvar_forceset(wasm_exec_env_t env, const char *name, const char *value)
 {
+	wasm_sync_memory();
+
 	wasm_mapped_cvar_t *mapped = fetch_mapped_cvar(name);
 	wasm_cvar_t *wasm_cvar;
 
@@ -205,7 +208,7 @@ static tagged_block_t *tagged_blocks;
 static uint32_t q2_TagMalloc(wasm_exec_env_t env, uint32_t size, uint32_t tag)
 {
 	void *ptr;
-	uint32_t loc = wasm_runtime_module_malloc(wasm.module_inst, size, &ptr);
+	uint32_t loc = wasm_module_malloc(size, &ptr);
 
 	if (!loc)
 		wasm_error("Out of WASM memory");
@@ -225,6 +228,8 @@ static uint32_t q2_TagMalloc(wasm_exec_env_t env, uint32_t size, uint32_t tag)
 
 static void q2_TagFree(wasm_exec_env_t env, void *ptr)
 {
+	wasm_sync_memory();
+
 	wasm_runtime_module_free(wasm.module_inst, wasm_native_to_addr(ptr));
 
 	for (tagged_block_t **block = &tagged_blocks; *block; )
@@ -258,143 +263,318 @@ static void q2_FreeTags(wasm_exec_env_t env, uint32_t tag)
 #include <stdlib.h>
 
 #ifdef KMQUAKE2_ENGINE_MOD
-bool stat_offsets[MAX_STATS];
+uint16_t configstring_remap[MAX_VANILLA_CONFIGSTRINGS];
+uint8_t remap_stats[MAX_VANILLA_STATS];
+int32_t num_remap_stats;
+
+void q2_wasm_init_configstring_remap(void)
+{
+	static const struct {
+		int32_t	vanilla, native;
+	} ranges[] = {
+		{ CS_VANILLA_GENERAL, CS_GENERAL },
+		{ CS_VANILLA_PLAYERSKINS, CS_PLAYERSKINS },
+		{ CS_VANILLA_ITEMS, CS_ITEMS },
+		{ CS_VANILLA_LIGHTS, CS_LIGHTS },
+		{ CS_VANILLA_IMAGES, CS_IMAGES },
+		{ CS_VANILLA_SOUNDS, CS_SOUNDS },
+		{ 0, 0 }
+	};
 
-#define MAX_TOKEN_CHARS 64
-static char     com_token[4][MAX_TOKEN_CHARS];
-static int      com_tokidx;
+	for (int32_t id = 0; id < MAX_VANILLA_CONFIGSTRINGS; id++)
+	{
+		int32_t r = 0;
 
-/*
-==============
-COM_Parse
+		while (id < ranges[r].vanilla)
+			r++;
 
-Parse a token out of a string.
-Handles C and C++ comments.
-==============
-*/
-static char *COM_Parse(const char **data_p)
-{
-    int         c;
-    int         len;
-    const char  *data;
-    char        *s = com_token[com_tokidx++ & 3];
-
-    data = *data_p;
-    len = 0;
-    s[0] = 0;
-
-    if (!data) {
-        *data_p = NULL;
-        return s;
-    }
-
-// skip whitespace
-skipwhite:
-    while ((c = *data) <= ' ') {
-        if (c == 0) {
-            *data_p = NULL;
-            return s;
-        }
-        data++;
-    }
-
-// skip // comments
-    if (c == '/' && data[1] == '/') {
-        data += 2;
-        while (*data && *data != '\n')
-            data++;
-        goto skipwhite;
-    }
-
-// skip /* */ comments
-    if (c == '/' && data[1] == '*') {
-        data += 2;
-        while (*data) {
-            if (data[0] == '*' && data[1] == '/') {
-                data += 2;
-                break;
-            }
-            data++;
-        }
-        goto skipwhite;
-    }
-
-// handle quoted strings specially
-    if (c == '\"') {
-        data++;
-        while (1) {
-            c = *data++;
-            if (c == '\"' || !c) {
-                goto finish;
-            }
-
-            if (len < MAX_TOKEN_CHARS - 1) {
-                s[len++] = c;
-            }
-        }
-    }
-
-// parse a regular word
-    do {
-        if (len < MAX_TOKEN_CHARS - 1) {
-            s[len++] = c;
-        }
-        data++;
-        c = *data;
-    } while (c > 32);
-
-finish:
-    s[len] = 0;
-
-    *data_p = data;
-    return s;
+		configstring_remap[id] = (uint16_t) (id - ranges[r].vanilla + ranges[r].native);
+	}
 }
-#endif
 
-static void q2_configstring(wasm_exec_env_t env, int32_t id, const char *value)
+// Returns the next token of a layout string, without the quotes if it
+// had them. Layouts don't have comments, so this skips the rest of what
+// COM_Parse would do.
+static const char *statusbar_token(const char **data_p, size_t *len)
 {
-#ifdef KMQUAKE2_ENGINE_MOD
-	id = wasm_remap_configstring(id);
+	const char *data = *data_p;
 
-	if (id == CS_STATUSBAR)
+	while (*data && (uint8_t) *data <= ' ')
+		data++;
+
+	if (!*data)
+		return NULL;
+
+	const char *start;
+
+	if (*data == '"')
+	{
+		start = ++data;
+
+		while (*data && *data != '"')
+			data++;
+
+		*len = data - start;
+
+		if (*data)
+			data++;
+	}
+	else
+	{
+		start = data;
+
+		while ((uint8_t) *data > ' ')
+			data++;
+
+		*len = data - start;
+	}
+
+	*data_p = data;
+	return start;
+}
+
+// Builds the list of stats that the statusbar draws as configstrings;
+// only those need to be remapped when syncing clients.
+static void compile_statusbar(const char *layout)
+{
+	bool seen[MAX_VANILLA_STATS] = { false };
+	const char *t;
+	size_t len;
+
+	num_remap_stats = 0;
+
+	while ((t = statusbar_token(&layout, &len)))
 	{
-		memset(stat_offsets, 0, sizeof(stat_offsets));
+		if (len != 11 || strncmp(t, "stat_string", 11))
+			continue;
+
+		if (!(t = statusbar_token(&layout, &len)))
+			break;
 
-		char *p = value, *t;
+		const int32_t stat = atoi(t);
 
-		while ((t = COM_Parse(&p)) && *t && p)
+		if (stat >= 0 && stat < MAX_VANILLA_STATS && !seen[stat])
 		{
-			if (strcmp(t, "stat_string"))
-				continue;
+			seen[stat] = true;
+			remap_stats[num_remap_stats++] = (uint8_t) stat;
+		}
+	}
+}
+#endif
+
+// Last value we sent for each configstring, indexed post-remap. The engine
+// broadcasts every configstring update to every client, so re-sending the
+// same value is dropped here. NULL means we don't know what the engine has.
+static char *configstring_shadow[MAX_CONFIGSTRINGS];
+
+static void configstring_forget(int32_t id)
+{
+	if (configstring_shadow[id])
+	{
+		gi.TagFree(configstring_shadow[id]);
+		configstring_shadow[id] = NULL;
+	}
+}
+
+void q2_wasm_clear_configstrings(void)
+{
+	for (int32_t i = 0; i < MAX_CONFIGSTRINGS; i++)
+		configstring_forget(i);
+}
+
+// Name -> index lookups are cached on our side, since the engine does
+// a linear search over the whole configstring range for each one. The
+// cache is only valid for the current level, so entries are TAG_LEVEL.
+#define INDEX_CACHE_HASH_SIZE	1024
+
+typedef struct index_cache_entry_s
+{
+	struct index_cache_entry_s	*next;
+	int32_t						index;
+	char						name[];
+} index_cache_entry_t;
+
+static index_cache_entry_t *index_cache[PRECACHE_NUM_KINDS][INDEX_CACHE_HASH_SIZE];
+
+static const int32_t index_cache_base[PRECACHE_NUM_KINDS] = {
+	[PRECACHE_MODEL] = CS_MODELS,
+	[PRECACHE_SOUND] = CS_SOUNDS,
+	[PRECACHE_IMAGE] = CS_IMAGES
+};
+
+static inline uint32_t index_cache_hash(const char *name)
+{
+	uint32_t hash = 2166136261u;
+
+	for (; *name; name++)
+		hash = (hash ^ (uint8_t) *name) * 16777619u;
+
+	return hash & (INDEX_CACHE_HASH_SIZE - 1);
+}
 
-			t = COM_Parse(&p);
+static int32_t index_cache_find(precache_kind_t kind, const char *value, int32_t (*find)(const char *))
+{
+	// null/empty names are always index 0, let the engine deal with them
+	if (!value || !*value)
+		return find(value);
+
+	const uint32_t hash = index_cache_hash(value);
+
+	for (index_cache_entry_t *entry = index_cache[kind][hash]; entry; entry = entry->next)
+		if (!strcmp(entry->name, value))
+			return entry->index;
+
+	const int32_t index = find(value);
+
+	if (!index)
+		return index;
+
+	// the engine may have just filled this slot in itself
+	configstring_forget(index_cache_base[kind] + index);
+
+	const size_t len = strlen(value) + 1;
+	index_cache_entry_t *entry = (index_cache_entry_t *) gi.TagMalloc((int32_t) (sizeof(index_cache_entry_t) + len), TAG_LEVEL);
+
+	entry->index = index;
+	memcpy(entry->name, value, len);
+	entry->next = index_cache[kind][hash];
+	index_cache[kind][hash] = entry;
+
+	return index;
+}
+
+// the game is free to overwrite these configstrings directly, so
+// anything cached for that index has to go.
+static void index_cache_invalidate(int32_t id)
+{
+	precache_kind_t kind;
+
+	if (id >= CS_MODELS && id < CS_SOUNDS)
+	{
+		kind = PRECACHE_MODEL;
+		id -= CS_MODELS;
+	}
+	else if (id >= CS_SOUNDS && id < CS_IMAGES)
+	{
+		kind = PRECACHE_SOUND;
+		id -= CS_SOUNDS;
+	}
+	else if (id >= CS_IMAGES && id < CS_LIGHTS)
+	{
+		kind = PRECACHE_IMAGE;
+		id -= CS_IMAGES;
+	}
+	else
+		return;
 
-			if (*t && p)
-				stat_offsets[atoi(t)] = true;
+	for (int32_t i = 0; i < INDEX_CACHE_HASH_SIZE; i++)
+	{
+		for (index_cache_entry_t **entry = &index_cache[kind][i]; *entry; )
+		{
+			if ((*entry)->index == id)
+				*entry = (*entry)->next;
+			else
+				entry = &(*entry)->next;
 		}
 	}
+}
+
+void q2_wasm_clear_index_cache(void)
+{
+	memset(index_cache, 0, sizeof(index_cache));
+}
+
+static void q2_configstring(wasm_exec_env_t env, int32_t id, const char *value)
+{
+	wasm_sync_memory();
+
+	q2_wasm_drain_deferred();
+
+#ifdef KMQUAKE2_ENGINE_MOD
+	id = wasm_remap_configstring(id);
+#endif
+
+	if (id < 0 || id >= MAX_CONFIGSTRINGS)
+		wasm_error("Bad configstring index");
+
+	if (configstring_shadow[id] && !strcmp(configstring_shadow[id], value))
+		return;
+
+	configstring_forget(id);
+
+	const size_t len = strlen(value) + 1;
+	configstring_shadow[id] = (char *) gi.TagMalloc((int32_t) len, TAG_LEVEL);
+	memcpy(configstring_shadow[id], value, len);
+
+#ifdef KMQUAKE2_ENGINE_MOD
+	if (id == CS_STATUSBAR)
+		compile_statusbar(value);
 #endif
 
+	index_cache_invalidate(id);
+
 	gi.configstring(id, value);
 }
 
 static int32_t q2_modelindex(wasm_exec_env_t env, const char *value)
 {
-	return gi.modelindex(value);
+	return index_cache_find(PRECACHE_MODEL, value, gi.modelindex);
 }
 
 static int32_t q2_imageindex(wasm_exec_env_t env, const char *value)
 {
-	return gi.imageindex(value);
+	return index_cache_find(PRECACHE_IMAGE, value, gi.imageindex);
 }
 
 static int32_t q2_soundindex(wasm_exec_env_t env, const char *value)
 {
-	return gi.soundindex(value);
+	return index_cache_find(PRECACHE_SOUND, value, gi.soundindex);
+}
+
+static void q2_precache_batch(wasm_exec_env_t env, wasm_precache_t *entries, uint32_t count)
+{
+	wasm_sync_memory();
+
+	if (count > UINT32_MAX / sizeof(wasm_precache_t) || !wasm_validate_ptr(entries, count * sizeof(wasm_precache_t)))
+		wasm_error("Invalid pointer");
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		wasm_precache_t *entry = &entries[i];
+
+		if (entry->kind >= PRECACHE_NUM_KINDS)
+			wasm_error("Invalid precache kind");
+
+		if (!entry->name)
+		{
+			entry->index = 0;
+			continue;
+		}
+
+		if (!wasm_runtime_validate_app_str_addr(wasm.module_inst, entry->name))
+			wasm_error("Invalid pointer");
+
+		const char *name = (const char *) wasm_addr_to_native(entry->name);
+
+		switch (entry->kind)
+		{
+		case PRECACHE_MODEL:
+			entry->index = index_cache_find(PRECACHE_MODEL, name, gi.modelindex);
+			break;
+		case PRECACHE_SOUND:
+			entry->index = index_cache_find(PRECACHE_SOUND, name, gi.soundindex);
+			break;
+		case PRECACHE_IMAGE:
+			entry->index = index_cache_find(PRECACHE_IMAGE, name, gi.imageindex);
+			break;
+		}
+	}
 }
 
 static void q2_cprint(wasm_exec_env_t env, wasm_edict_t *ent, print_level_t print_level, const char *str)
 {
+	wasm_sync_memory();
+
 	if (!entity_validate_wnp(ent))
 		wasm_error("Invalid pointer");
 
@@ -403,6 +583,8 @@ static void q2_cprint(wasm_exec_env_t env, wasm_edict_t *ent, print_level_t prin
 
 static void q2_centerprint(wasm_exec_env_t env, wasm_edict_t *ent, const char *str)
 {
+	wasm_sync_memory();
+
 	if (!entity_validate_wnp(ent))
 		wasm_error("Invalid pointer");
 
@@ -411,16 +593,73 @@ static void q2_centerprint(wasm_exec_env_t env, wasm_edict_t *ent, const char *s
 
 static void q2_error(wasm_exec_env_t env, const char *str)
 {
+	q2_wasm_drain_deferred();
 	wasm_error(str);
 }
 
-static void q2_linkentity(wasm_exec_env_t env, wasm_edict_t *wasm_edict)
+// The imports games call the most are registered either the regular way,
+// or through WAMR's raw API (the _raw functions), which hands over the
+// arguments as they are and leaves decoding them to us. Both can be timed
+// from entry to exit, to see what the difference is.
+typedef enum
 {
-	if (!entity_validate_wnp(wasm_edict))
+	HOT_TRACE,
+	HOT_POINTCONTENTS,
+	HOT_LINKENTITY,
+	HOT_WRITEMESSAGE,
+	HOT_SOUND,
+	HOT_BOXEDICTS,
+
+	HOT_NUM_IMPORTS
+} hot_import_t;
+
+static const char *const hot_import_names[HOT_NUM_IMPORTS] = {
+	"trace", "pointcontents", "linkentity", "WriteMessage", "sound", "BoxEdicts"
+};
+
+static struct
+{
+	bool		raw, timed;
+	uint64_t	calls[HOT_NUM_IMPORTS];
+	uint64_t	nsec[HOT_NUM_IMPORTS];
+} hot_imports;
+
+#define HOT_BEGIN() \
+	const uint64_t hot_start = hot_imports.timed ? wasm_time_nsec() : 0
+
+#define HOT_END(which) \
+	if (hot_imports.timed) \
+	{ \
+		hot_imports.calls[which]++; \
+		hot_imports.nsec[which] += wasm_time_nsec() - hot_start; \
+	}
+
+// edict argument of a raw import; NULL stays NULL
+static wasm_edict_t *raw_edict(const wasm_raw_memory_t *memory, wasm_entity_address_t addr)
+{
+	if (!addr)
+		return NULL;
+
+	wasm_edict_t *e = entity_validate_wa(addr) ? (wasm_edict_t *) wasm_raw_ptr(memory, addr, sizeof(wasm_edict_t)) : NULL;
+
+	if (!e)
 		wasm_error("Invalid pointer");
 
-	edict_t *native_edict = entity_wnp_to_np(wasm_edict);
+	return e;
+}
+
+static const char *raw_string(const wasm_raw_memory_t *memory, wasm_addr_t addr)
+{
+	const char *str = (const char *) wasm_raw_ptr(memory, addr, 1);
+
+	if (!str || !memchr(str, 0, memory->size - addr))
+		wasm_error("Invalid pointer");
 
+	return str;
+}
+
+static void link_entity(wasm_edict_t *wasm_edict, edict_t *native_edict)
+{
 	copy_link_wasm_to_native(native_edict, wasm_edict);
 	const bool copy_old_origin = wasm_edict->linkcount == 0;
 	gi.linkentity(native_edict);
@@ -429,8 +668,40 @@ static void q2_linkentity(wasm_exec_env_t env, wasm_edict_t *wasm_edict)
 	copy_link_native_to_wasm(wasm_edict, native_edict);
 }
 
+static void q2_linkentity(wasm_exec_env_t env, wasm_edict_t *wasm_edict)
+{
+	wasm_sync_memory();
+
+	HOT_BEGIN();
+
+	if (!entity_validate_wnp(wasm_edict))
+		wasm_error("Invalid pointer");
+
+	link_entity(wasm_edict, entity_wnp_to_np(wasm_edict));
+
+	HOT_END(HOT_LINKENTITY);
+}
+
+static void q2_linkentity_raw(wasm_exec_env_t env, uint64_t *args)
+{
+	HOT_BEGIN();
+
+	const wasm_raw_memory_t memory = wasm_raw_memory();
+	const wasm_entity_address_t addr = WASM_RAW_U32(args, 0);
+	wasm_edict_t *wasm_edict = raw_edict(&memory, addr);
+
+	if (!wasm_edict)
+		wasm_error("Invalid pointer");
+
+	link_entity(wasm_edict, entity_wa_to_np(addr));
+
+	HOT_END(HOT_LINKENTITY);
+}
+
 static void q2_unlinkentity(wasm_exec_env_t env, wasm_edict_t *wasm_edict)
 {
+	wasm_sync_memory();
+
 	if (!entity_validate_wnp(wasm_edict))
 		wasm_error("Invalid pointer");
 
@@ -443,6 +714,8 @@ static void q2_unlinkentity(wasm_exec_env_t env, wasm_edict_t *wasm_edict)
 
 static void q2_setmodel(wasm_exec_env_t env, wasm_edict_t *wasm_edict, const char *model)
 {
+	wasm_sync_memory();
+
 	if (!entity_validate_wnp(wasm_edict))
 		wasm_error("Invalid pointer");
 
@@ -485,13 +758,8 @@ static surf_cache_t surf_cache;
 // WASM address to the currently-processing pmove.
 static uint32_t wasm_pmove_ptr;
 
-static void q2_trace(wasm_exec_env_t env, const vec_t start_x, const vec_t start_y, const vec_t start_z, const vec_t mins_x, const vec_t mins_y, const vec_t mins_z, const vec_t maxs_x, const vec_t maxs_y, const vec_t maxs_z, const vec_t end_x, const vec_t end_y, const vec_t end_z, wasm_edict_t *passent, content_flags_t contentmask, wasm_trace_t *out)
+static void trace_to_wasm(const vec3_t *start, const vec3_t *mins, const vec3_t *maxs, const vec3_t *end, edict_t *native_passent, content_flags_t contentmask, wasm_trace_t *out)
 {
-	if (!entity_validate_wnp(passent))
-		wasm_error("Invalid pointer");
-	if (!wasm_validate_ptr(out, sizeof(wasm_trace_t)))
-		wasm_error("Invalid pointer");
-
 	for (int32_t i = 0; i < globals.num_edicts; i++)
 	{
 		wasm_edict_t *e = entity_number_to_wnp(i);
@@ -500,21 +768,9 @@ static void q2_trace(wasm_exec_env_t env, const vec_t start_x, const vec_t start
 			sync_entity(e, entity_number_to_np(i), false);
 	}
 
-	edict_t *native_passent;
-
-	if (wasm_native_to_addr(passent) == 0)
-		native_passent = globals.edicts;
-	else
-		native_passent = entity_wnp_to_np(passent);
-
 	static trace_t tr;
 
-	const vec3_t start = { start_x, start_y, start_z };
-	const vec3_t mins = { mins_x, mins_y, mins_z };
-	const vec3_t maxs = { maxs_x, maxs_y, maxs_z };
-	const vec3_t end = { end_x, end_y, end_z };
-
-	tr = gi.trace(&start, &mins, &maxs, &end, native_passent, contentmask);
+	tr = gi.trace(start, mins, maxs, end, native_passent, contentmask);
 
 	out->allsolid = tr.allsolid;
 	out->contents = tr.contents;
@@ -551,7 +807,7 @@ static void q2_trace(wasm_exec_env_t env, const vec_t start_x, const vec_t start
 
 	csurface_t *wasm_surf;
 
-	out->surface = entry->wasm = wasm_runtime_module_malloc(wasm.module_inst, sizeof(csurface_t), (void **) &wasm_surf);
+	out->surface = entry->wasm = wasm_module_malloc(sizeof(csurface_t), (void **) &wasm_surf);
 
 	if (!out->surface)
 		wasm_error("Out of WASM memory");
@@ -564,6 +820,55 @@ static void q2_trace(wasm_exec_env_t env, const vec_t start_x, const vec_t start
 	surf_cache.wasm_hash[wasm_hash] = entry;
 }
 
+static void q2_trace(wasm_exec_env_t env, const vec_t start_x, const vec_t start_y, const vec_t start_z, const vec_t mins_x, const vec_t mins_y, const vec_t mins_z, const vec_t maxs_x, const vec_t maxs_y, const vec_t maxs_z, const vec_t end_x, const vec_t end_y, const vec_t end_z, wasm_edict_t *passent, content_flags_t contentmask, wasm_trace_t *out)
+{
+	wasm_sync_memory();
+
+	HOT_BEGIN();
+
+	if (!entity_validate_wnp(passent))
+		wasm_error("Invalid pointer");
+	if (!wasm_validate_ptr(out, sizeof(wasm_trace_t)))
+		wasm_error("Invalid pointer");
+
+	edict_t *native_passent;
+
+	if (wasm_native_to_addr(passent) == 0)
+		native_passent = globals.edicts;
+	else
+		native_passent = entity_wnp_to_np(passent);
+
+	const vec3_t start = { start_x, start_y, start_z };
+	const vec3_t mins = { mins_x, mins_y, mins_z };
+	const vec3_t maxs = { maxs_x, maxs_y, maxs_z };
+	const vec3_t end = { end_x, end_y, end_z };
+
+	trace_to_wasm(&start, &mins, &maxs, &end, native_passent, contentmask, out);
+
+	HOT_END(HOT_TRACE);
+}
+
+static void q2_trace_raw(wasm_exec_env_t env, uint64_t *args)
+{
+	HOT_BEGIN();
+
+	const wasm_raw_memory_t memory = wasm_raw_memory();
+	const wasm_entity_address_t passent = WASM_RAW_U32(args, 12);
+	wasm_trace_t *out = (wasm_trace_t *) wasm_raw_ptr(&memory, WASM_RAW_U32(args, 14), sizeof(wasm_trace_t));
+
+	if (!entity_validate_wa(passent) || !out)
+		wasm_error("Invalid pointer");
+
+	const vec3_t start = { WASM_RAW_F32(args, 0), WASM_RAW_F32(args, 1), WASM_RAW_F32(args, 2) };
+	const vec3_t mins = { WASM_RAW_F32(args, 3), WASM_RAW_F32(args, 4), WASM_RAW_F32(args, 5) };
+	const vec3_t maxs = { WASM_RAW_F32(args, 6), WASM_RAW_F32(args, 7), WASM_RAW_F32(args, 8) };
+	const vec3_t end = { WASM_RAW_F32(args, 9), WASM_RAW_F32(args, 10), WASM_RAW_F32(args, 11) };
+
+	trace_to_wasm(&start, &mins, &maxs, &end, passent ? entity_wa_to_np(passent) : globals.edicts, WASM_RAW_I32(args, 13), out);
+
+	HOT_END(HOT_TRACE);
+}
+
 void q2_wasm_clear_surface_cache()
 {
 	memset(&surf_cache, 0, sizeof(surf_cache));
@@ -598,16 +903,7 @@ typedef struct
 
 static trace_t q2_wasm_pmove_trace(const vec3_t *start, const vec3_t *mins, const vec3_t *maxs, const vec3_t *end)
 {
-	uint32_t args[] = {
-		wasm_pmove_ptr,
-		ftoui32(start->x), ftoui32(start->y), ftoui32(start->z),
-		ftoui32(mins->x), ftoui32(mins->y), ftoui32(mins->z),
-		ftoui32(maxs->x), ftoui32(maxs->y), ftoui32(maxs->z),
-		ftoui32(end->x), ftoui32(end->y), ftoui32(end->z),
-		WASM_BUFFERS_OFFSET(trace)
-	};
-
-	wasm_call_args(wasm.WASM_PmoveTrace, args, lengthof(args));
+	q2_wasm_call_pmove_trace(wasm_pmove_ptr, start, mins, maxs, end, WASM_BUFFERS_OFFSET(trace));
 
 	const wasm_buffers_t *buffers = wasm_buffers();
 	const wasm_trace_t *wtr = &buffers->trace;
@@ -642,18 +938,13 @@ static trace_t q2_wasm_pmove_trace(const vec3_t *start, const vec3_t *mins, cons
 
 static content_flags_t q2_wasm_pmove_pointcontents(const vec3_t *start)
 {
-	uint32_t args[] = {
-		wasm_pmove_ptr,
-		ftoui32(start->x), ftoui32(start->y), ftoui32(start->z)
-	};
-
-	wasm_call_args(wasm.WASM_PmovePointContents, args, lengthof(args));
-
-	return args[0];
+	return q2_wasm_call_pmove_pointcontents(wasm_pmove_ptr, start);
 }
 
 static void q2_Pmove(wasm_exec_env_t env, wasm_pmove_t *wasm_pmove)
 {
+	wasm_sync_memory();
+
 	if (!wasm_validate_ptr(wasm_pmove, sizeof(wasm_pmove_t)))
 		wasm_error("Invalid pointer");
 
@@ -684,8 +975,23 @@ static void q2_Pmove(wasm_exec_env_t env, wasm_pmove_t *wasm_pmove)
 
 static content_flags_t q2_pointcontents(wasm_exec_env_t env, const vec_t p_x, const vec_t p_y, const vec_t p_z)
 {
+	HOT_BEGIN();
+
 	const vec3_t p = { p_x, p_y, p_z };
-	return gi.pointcontents(&p);
+	const content_flags_t contents = gi.pointcontents(&p);
+
+	HOT_END(HOT_POINTCONTENTS);
+	return contents;
+}
+
+static void q2_pointcontents_raw(wasm_exec_env_t env, uint64_t *args)
+{
+	HOT_BEGIN();
+
+	const vec3_t p = { WASM_RAW_F32(args, 0), WASM_RAW_F32(args, 1), WASM_RAW_F32(args, 2) };
+	WASM_RAW_I32(args, 0) = gi.pointcontents(&p);
+
+	HOT_END(HOT_POINTCONTENTS);
 }
 
 static void q2_WriteAngle(wasm_exec_env_t env, vec_t c)
@@ -735,39 +1041,235 @@ static void q2_WriteString(wasm_exec_env_t env, const char *p)
 	gi.WriteString(p);
 }
 
-static void q2_unicast(wasm_exec_env_t env, wasm_edict_t *ent, qboolean reliable)
+static void q2_WriteAngle_raw(wasm_exec_env_t env, uint64_t *args)
 {
-	if (!entity_validate_wnp(ent))
-		wasm_error("Invalid pointer");
+	gi.WriteAngle(WASM_RAW_F32(args, 0));
+}
 
-	gi.unicast(entity_wnp_to_np(ent), reliable);
+static void q2_WriteByte_raw(wasm_exec_env_t env, uint64_t *args)
+{
+	gi.WriteByte(WASM_RAW_I32(args, 0));
 }
 
-static void q2_multicast(wasm_exec_env_t env, const vec_t origin_x, const vec_t origin_y, const vec_t origin_z, multicast_t to)
+static void q2_WriteChar_raw(wasm_exec_env_t env, uint64_t *args)
 {
-	const vec3_t origin = { origin_x, origin_y, origin_z };
-	gi.multicast(&origin, to);
+	gi.WriteChar(WASM_RAW_I32(args, 0));
 }
 
-static int32_t q2_BoxEdicts(wasm_exec_env_t env, const vec_t mins_x, const vec_t mins_y, const vec_t mins_z, const vec_t maxs_x, const vec_t maxs_y, const vec_t maxs_z, uint32_t *list, int32_t maxcount, box_edicts_area_t areatype)
+static void q2_WriteDir_raw(wasm_exec_env_t env, uint64_t *args)
 {
-	if (!wasm_validate_ptr(list, sizeof(uint32_t) * maxcount))
-		wasm_error("Invalid pointer");
+	const vec3_t p = { WASM_RAW_F32(args, 0), WASM_RAW_F32(args, 1), WASM_RAW_F32(args, 2) };
+	gi.WriteDir(&p);
+}
 
-	for (int32_t i = 0; i < globals.num_edicts; i++)
-	{
-		wasm_edict_t *e = entity_number_to_wnp(i);
-		edict_t *n = entity_number_to_np(i);
+static void q2_WriteFloat_raw(wasm_exec_env_t env, uint64_t *args)
+{
+	gi.WriteFloat(WASM_RAW_F32(args, 0));
+}
 
-		if (e->inuse)
-			sync_entity(e, n, false);
-	}
+static void q2_WriteLong_raw(wasm_exec_env_t env, uint64_t *args)
+{
+	gi.WriteLong(WASM_RAW_I32(args, 0));
+}
 
-	static edict_t *elist[MAX_EDICTS];
+static void q2_WritePosition_raw(wasm_exec_env_t env, uint64_t *args)
+{
+	const vec3_t p = { WASM_RAW_F32(args, 0), WASM_RAW_F32(args, 1), WASM_RAW_F32(args, 2) };
+	gi.WritePosition(&p);
+}
 
-	const vec3_t mins = { mins_x, mins_y, mins_z };
-	const vec3_t maxs = { maxs_x, maxs_y, maxs_z };
-	int32_t count = gi.BoxEdicts(&mins, &maxs, elist, maxcount, areatype);
+static void q2_WriteShort_raw(wasm_exec_env_t env, uint64_t *args)
+{
+	gi.WriteShort(WASM_RAW_I32(args, 0));
+}
+
+static void q2_WriteString_raw(wasm_exec_env_t env, uint64_t *args)
+{
+	const wasm_raw_memory_t memory = wasm_raw_memory();
+	gi.WriteString(raw_string(&memory, WASM_RAW_U32(args, 0)));
+}
+
+// replays a buffer of message primitives encoded by the WASM side
+static void replay_message(const uint8_t *data, uint32_t length)
+{
+	const uint8_t *end = data + length;
+
+#define MSG_READ(v) \
+	if (end - data < (ptrdiff_t) sizeof(v)) \
+		wasm_error("Bad message buffer"); \
+	memcpy(&(v), data, sizeof(v)); \
+	data += sizeof(v)
+
+	while (data < end)
+	{
+		const uint8_t op = *data++;
+
+		switch (op)
+		{
+		case MSG_OP_CHAR: {
+			int8_t c;
+			MSG_READ(c);
+			gi.WriteChar(c);
+			break;
+		}
+		case MSG_OP_BYTE: {
+			uint8_t c;
+			MSG_READ(c);
+			gi.WriteByte(c);
+			break;
+		}
+		case MSG_OP_SHORT: {
+			int16_t c;
+			MSG_READ(c);
+			gi.WriteShort(c);
+			break;
+		}
+		case MSG_OP_LONG: {
+			int32_t c;
+			MSG_READ(c);
+			gi.WriteLong(c);
+			break;
+		}
+		case MSG_OP_FLOAT: {
+			vec_t f;
+			MSG_READ(f);
+			gi.WriteFloat(f);
+			break;
+		}
+		case MSG_OP_ANGLE: {
+			vec_t f;
+			MSG_READ(f);
+			gi.WriteAngle(f);
+			break;
+		}
+		case MSG_OP_POSITION: {
+			vec3_t p;
+			MSG_READ(p);
+			gi.WritePosition(&p);
+			break;
+		}
+		case MSG_OP_DIR: {
+			vec3_t p;
+			MSG_READ(p);
+			gi.WriteDir(&p);
+			break;
+		}
+		case MSG_OP_STRING: {
+			const uint8_t *s = memchr(data, 0, end - data);
+
+			if (!s)
+				wasm_error("Bad message buffer");
+
+			gi.WriteString((const char *) data);
+			data = s + 1;
+			break;
+		}
+		default:
+			wasm_error("Bad message buffer");
+		}
+	}
+
+#undef MSG_READ
+}
+
+// sounds go through the multicast buffer too, so anything deferred
+// has to go out before we start filling it with a message.
+static void q2_WriteMessage(wasm_exec_env_t env, const uint8_t *data, uint32_t length)
+{
+	wasm_sync_memory();
+
+	HOT_BEGIN();
+
+	q2_wasm_drain_deferred();
+	replay_message(data, length);
+
+	HOT_END(HOT_WRITEMESSAGE);
+}
+
+static void q2_WriteMessage_raw(wasm_exec_env_t env, uint64_t *args)
+{
+	HOT_BEGIN();
+
+	const wasm_raw_memory_t memory = wasm_raw_memory();
+	const uint32_t length = WASM_RAW_U32(args, 1);
+	const uint8_t *data = (const uint8_t *) wasm_raw_ptr(&memory, WASM_RAW_U32(args, 0), length);
+
+	if (!data)
+		wasm_error("Invalid pointer");
+
+	q2_wasm_drain_deferred();
+	replay_message(data, length);
+
+	HOT_END(HOT_WRITEMESSAGE);
+}
+
+static void q2_unicast_mask(wasm_exec_env_t env, const uint8_t *data, uint32_t length, const uint32_t *clients, const uint32_t *reliable)
+{
+	wasm_sync_memory();
+
+	if (!wasm_validate_ptr(clients, sizeof(client_mask_t)) ||
+		!wasm_validate_ptr(reliable, sizeof(client_mask_t)))
+		wasm_error("Invalid pointer");
+
+	q2_wasm_drain_deferred();
+
+	const int32_t num_clients = max_clients < MAX_CLIENTS ? max_clients : MAX_CLIENTS;
+
+	for (int32_t i = 0; i < num_clients && i + 1 < globals.num_edicts; i++)
+	{
+		if (!CLIENT_MASK_TEST(clients, i))
+			continue;
+
+		edict_t *ent = entity_number_to_np(i + 1);
+
+		// like the engine's multicast, only clients that are in the game
+		if (!ent->inuse || !ent->client)
+			continue;
+
+		replay_message(data, length);
+		gi.unicast(ent, CLIENT_MASK_TEST(reliable, i) ? qtrue : qfalse);
+	}
+}
+
+static void q2_unicast(wasm_exec_env_t env, wasm_edict_t *ent, qboolean reliable)
+{
+	wasm_sync_memory();
+
+	if (!entity_validate_wnp(ent))
+		wasm_error("Invalid pointer");
+
+	q2_wasm_drain_deferred();
+
+	gi.unicast(entity_wnp_to_np(ent), reliable);
+}
+
+static void q2_multicast(wasm_exec_env_t env, const vec_t origin_x, const vec_t origin_y, const vec_t origin_z, multicast_t to)
+{
+	wasm_sync_memory();
+
+	q2_wasm_drain_deferred();
+
+	const vec3_t origin = { origin_x, origin_y, origin_z };
+	gi.multicast(&origin, to);
+}
+
+static int32_t box_edicts(const vec3_t *mins, const vec3_t *maxs, uint32_t *list, int32_t maxcount, box_edicts_area_t areatype)
+{
+	for (int32_t i = 0; i < globals.num_edicts; i++)
+	{
+		wasm_edict_t *e = entity_number_to_wnp(i);
+		edict_t *n = entity_number_to_np(i);
+
+		if (e->inuse)
+			sync_entity(e, n, false);
+	}
+
+	static edict_t *elist[MAX_EDICTS];
+
+	if (maxcount > MAX_EDICTS)
+		maxcount = MAX_EDICTS;
+
+	int32_t count = gi.BoxEdicts(mins, maxs, elist, maxcount, areatype);
 
 	for (int32_t i = 0; i < count; i++)
 		list[i] = entity_np_to_wa(elist[i]);
@@ -775,21 +1277,81 @@ static int32_t q2_BoxEdicts(wasm_exec_env_t env, const vec_t mins_x, const vec_t
 	return count;
 }
 
-static void q2_sound(wasm_exec_env_t env, wasm_edict_t *ent, sound_channel_t channel, int32_t soundindex, vec_t volume, sound_attn_t attenuation, vec_t timeofs)
+static int32_t q2_BoxEdicts(wasm_exec_env_t env, const vec_t mins_x, const vec_t mins_y, const vec_t mins_z, const vec_t maxs_x, const vec_t maxs_y, const vec_t maxs_z, uint32_t *list, int32_t maxcount, box_edicts_area_t areatype)
 {
-	if (!entity_validate_wnp(ent))
+	wasm_sync_memory();
+
+	HOT_BEGIN();
+
+	if (maxcount < 0 || !wasm_validate_ptr(list, sizeof(uint32_t) * maxcount))
 		wasm_error("Invalid pointer");
 
-	edict_t *native = entity_wnp_to_np(ent);
+	const vec3_t mins = { mins_x, mins_y, mins_z };
+	const vec3_t maxs = { maxs_x, maxs_y, maxs_z };
+	const int32_t count = box_edicts(&mins, &maxs, list, maxcount, areatype);
+
+	HOT_END(HOT_BOXEDICTS);
+	return count;
+}
+
+static void q2_BoxEdicts_raw(wasm_exec_env_t env, uint64_t *args)
+{
+	HOT_BEGIN();
+
+	const wasm_raw_memory_t memory = wasm_raw_memory();
+	const int32_t maxcount = WASM_RAW_I32(args, 7);
+	uint32_t *list = maxcount < 0 ? NULL : (uint32_t *) wasm_raw_ptr(&memory, WASM_RAW_U32(args, 6), sizeof(uint32_t) * (uint64_t) maxcount);
+
+	if (!list)
+		wasm_error("Invalid pointer");
+
+	const vec3_t mins = { WASM_RAW_F32(args, 0), WASM_RAW_F32(args, 1), WASM_RAW_F32(args, 2) };
+	const vec3_t maxs = { WASM_RAW_F32(args, 3), WASM_RAW_F32(args, 4), WASM_RAW_F32(args, 5) };
+
+	WASM_RAW_I32(args, 0) = box_edicts(&mins, &maxs, list, maxcount, (box_edicts_area_t) WASM_RAW_I32(args, 8));
+
+	HOT_END(HOT_BOXEDICTS);
+}
 
+static void start_sound(wasm_edict_t *ent, edict_t *native, sound_channel_t channel, int32_t soundindex, vec_t volume, sound_attn_t attenuation, vec_t timeofs)
+{
 	if (native)
 		sync_entity(ent, native, false);
 
 	gi.sound(native, channel, soundindex, volume, attenuation, timeofs);
 }
 
+static void q2_sound(wasm_exec_env_t env, wasm_edict_t *ent, sound_channel_t channel, int32_t soundindex, vec_t volume, sound_attn_t attenuation, vec_t timeofs)
+{
+	wasm_sync_memory();
+
+	HOT_BEGIN();
+
+	if (!entity_validate_wnp(ent))
+		wasm_error("Invalid pointer");
+
+	start_sound(ent, entity_wnp_to_np(ent), channel, soundindex, volume, attenuation, timeofs);
+
+	HOT_END(HOT_SOUND);
+}
+
+static void q2_sound_raw(wasm_exec_env_t env, uint64_t *args)
+{
+	HOT_BEGIN();
+
+	const wasm_raw_memory_t memory = wasm_raw_memory();
+	const wasm_entity_address_t addr = WASM_RAW_U32(args, 0);
+
+	start_sound(raw_edict(&memory, addr), entity_wa_to_np(addr), (sound_channel_t) WASM_RAW_I32(args, 1), WASM_RAW_I32(args, 2),
+		WASM_RAW_F32(args, 3), (sound_attn_t) WASM_RAW_I32(args, 4), WASM_RAW_F32(args, 5));
+
+	HOT_END(HOT_SOUND);
+}
+
 static void q2_positioned_sound(wasm_exec_env_t env, vec_t origin_x, vec_t origin_y, vec_t origin_z, wasm_edict_t *ent, sound_channel_t channel, int32_t soundindex, vec_t volume, sound_attn_t attenuation, vec_t timeofs)
 {
+	wasm_sync_memory();
+
 	if (!entity_validate_wnp(ent))
 		wasm_error("Invalid pointer");
 
@@ -802,22 +1364,496 @@ static void q2_positioned_sound(wasm_exec_env_t env, vec_t origin_x, vec_t origi
 	gi.positioned_sound(&origin, native, channel, soundindex, volume, attenuation, timeofs);
 }
 
+// deferred imports; see g_wasm_ext.h
+static struct
+{
+	uint32_t	records, flushes;	// this frame
+	uint32_t	last_saved;			// crossings saved last frame
+	uint64_t	total_saved;
+	uint32_t	frames;
+} defer_stats;
+
+void q2_wasm_init_deferred(bool enabled)
+{
+	wasm.defer_queue = 0;
+
+	if (!enabled)
+		return;
+
+	wasm_defer_queue_t *queue;
+
+	wasm.defer_queue = wasm_module_malloc(sizeof(wasm_defer_queue_t) + WASM_DEFER_QUEUE_SIZE, (void **) &queue);
+
+	if (!wasm.defer_queue)
+		wasm_error("Unable to allocate WASM deferred import queue");
+
+	queue->length = queue->count = 0;
+	queue->size = WASM_DEFER_QUEUE_SIZE;
+}
+
+static edict_t *deferred_entity(wasm_entity_address_t addr, wasm_edict_t **wasm_edict)
+{
+	if (!addr)
+	{
+		*wasm_edict = NULL;
+		return NULL;
+	}
+
+	*wasm_edict = entity_wa_to_wnp(addr);
+
+	if (!entity_validate_wnp(*wasm_edict))
+		wasm_error("Invalid pointer");
+
+	return entity_wa_to_np(addr);
+}
+
+void q2_wasm_drain_deferred(void)
+{
+	if (!wasm.defer_queue)
+		return;
+
+	wasm_defer_queue_t *queue = (wasm_defer_queue_t *) wasm_addr_to_native(wasm.defer_queue);
+
+	if (!queue->length)
+		return;
+	else if (queue->length > WASM_DEFER_QUEUE_SIZE)
+		wasm_error("Bad deferred import queue");
+
+	const uint8_t *data = queue->data;
+	const uint8_t *end = data + queue->length;
+
+	defer_stats.records += queue->count;
+
+	// reset it first; if anything in here errors out,
+	// we don't want to see it again.
+	queue->length = queue->count = 0;
+
+	while (data < end)
+	{
+		const uint8_t op = *data++;
+
+		if (op == DEFER_OP_SOUND || op == DEFER_OP_POSITIONED_SOUND)
+		{
+			wasm_defer_sound_t snd;
+
+			if (end - data < (ptrdiff_t) sizeof(snd))
+				wasm_error("Bad deferred import queue");
+
+			memcpy(&snd, data, sizeof(snd));
+			data += sizeof(snd);
+
+			wasm_edict_t *ent;
+			edict_t *native = deferred_entity(snd.ent, &ent);
+
+			if (native)
+				sync_entity(ent, native, false);
+
+			if (op == DEFER_OP_SOUND)
+				gi.sound(native, snd.channel, snd.soundindex, snd.volume, snd.attenuation, snd.timeofs);
+			else
+				gi.positioned_sound(&snd.origin, native, snd.channel, snd.soundindex, snd.volume, snd.attenuation, snd.timeofs);
+		}
+		else if (op == DEFER_OP_BPRINT || op == DEFER_OP_CPRINT || op == DEFER_OP_CENTERPRINT)
+		{
+			wasm_defer_print_t print;
+
+			if (end - data < (ptrdiff_t) sizeof(print))
+				wasm_error("Bad deferred import queue");
+
+			memcpy(&print, data, sizeof(print));
+			data += sizeof(print);
+
+			const char *str = (const char *) data;
+			const uint8_t *str_end = memchr(data, 0, end - data);
+
+			if (!str_end)
+				wasm_error("Bad deferred import queue");
+
+			data = str_end + 1;
+
+			wasm_edict_t *ent;
+			edict_t *native = deferred_entity(print.ent, &ent);
+
+			if (op == DEFER_OP_BPRINT)
+				gi.bprintf(print.level, "%s", str);
+			else if (op == DEFER_OP_CPRINT)
+				gi.cprintf(native, print.level, "%s", str);
+			else
+				gi.centerprintf(native, "%s", str);
+		}
+		else
+			wasm_error("Bad deferred import queue");
+	}
+}
+
+static uint32_t q2_GetDeferQueue(wasm_exec_env_t env)
+{
+	return wasm.defer_queue;
+}
+
+static void q2_FlushDeferQueue(wasm_exec_env_t env)
+{
+	wasm_sync_memory();
+
+	defer_stats.flushes++;
+	q2_wasm_drain_deferred();
+}
+
+void q2_wasm_end_frame(void)
+{
+	defer_stats.last_saved = defer_stats.records - defer_stats.flushes;
+	defer_stats.total_saved += defer_stats.last_saved;
+	defer_stats.frames++;
+	defer_stats.records = defer_stats.flushes = 0;
+}
+
+void q2_wasm_print_stats(void)
+{
+	if (!wasm.defer_queue)
+		gi.dprintf("deferred imports: disabled\n");
+	else
+		gi.dprintf("deferred imports: %u crossings saved last frame, %.1f per frame on average\n",
+			defer_stats.last_saved, defer_stats.frames ? (double) defer_stats.total_saved / defer_stats.frames : 0.0);
+
+	if (!hot_imports.timed)
+		gi.dprintf("hot imports: %s, not timed (sys_wasmimporttimes)\n", hot_imports.raw ? "raw" : "regular");
+	else
+	{
+		gi.dprintf("hot imports: %s\n", hot_imports.raw ? "raw" : "regular");
+
+		for (int32_t i = 0; i < HOT_NUM_IMPORTS; i++)
+			gi.dprintf("  %-14s %10llu calls %8.1f ns per call\n", hot_import_names[i], (unsigned long long) hot_imports.calls[i],
+				hot_imports.calls[i] ? (double) hot_imports.nsec[i] / hot_imports.calls[i] : 0.0);
+	}
+
+	q2_wasm_print_memory_stats();
+}
+
+// Command arguments are only copied over when the game asks for them,
+// and kept around until the next command comes in.
+typedef struct
+{
+	wasm_string_t	str;
+	uint32_t		size;
+} cmd_arg_t;
+
+static struct
+{
+	cmd_arg_t	*argv;		// argc + 1 entries, the last one being ""
+	int32_t		argv_alloc;
+	int32_t		argc;		// -1 if not fetched yet
+	cmd_arg_t	args;
+} cmd_args = { .argc = -1 };
+
+void q2_wasm_reset_args(void)
+{
+	if (cmd_args.argc != -1)
+	{
+		for (int32_t i = 0; i <= cmd_args.argc; i++)
+			wasm_pool_free(cmd_args.argv[i].str, cmd_args.argv[i].size);
+
+		cmd_args.argc = -1;
+	}
+
+	wasm_pool_free(cmd_args.args.str, cmd_args.args.size);
+	cmd_args.args.str = 0;
+}
+
+static void fetch_argc(void)
+{
+	if (cmd_args.argc != -1)
+		return;
+
+	const int32_t argc = gi.argc();
+
+	if (argc + 1 > cmd_args.argv_alloc)
+	{
+		cmd_arg_t *argv = (cmd_arg_t *) gi.TagMalloc(sizeof(cmd_arg_t) * (argc + 1) * 2, TAG_GAME);
+
+		if (cmd_args.argv)
+			gi.TagFree(cmd_args.argv);
+
+		cmd_args.argv = argv;
+		cmd_args.argv_alloc = (argc + 1) * 2;
+	}
+
+	memset(cmd_args.argv, 0, sizeof(cmd_arg_t) * (argc + 1));
+	cmd_args.argc = argc;
+}
+
 static int32_t q2_argc(wasm_exec_env_t env)
 {
-	return gi.argc();
+	fetch_argc();
+
+	return cmd_args.argc;
 }
 
 static uint32_t q2_argv(wasm_exec_env_t env, int32_t i)
 {
-	if (i < 0 || i >= lengthof(wasm_buffers()->cmds))
-		return 0;
+	wasm_sync_memory();
+
+	fetch_argc();
+
+	// the engine returns an empty string for these
+	if (i < 0 || i > cmd_args.argc)
+		i = cmd_args.argc;
+
+	cmd_arg_t *arg = &cmd_args.argv[i];
+
+	if (!arg->str)
+		arg->str = wasm_pool_dup_str(gi.argv(i), &arg->size);
 
-	return WASM_BUFFERS_OFFSET(cmds[i]);
+	return arg->str;
 }
 
 static uint32_t q2_args(wasm_exec_env_t env)
 {
-	return WASM_BUFFERS_OFFSET(scmd);
+	wasm_sync_memory();
+
+	if (!cmd_args.args.str)
+		cmd_args.args.str = wasm_pool_dup_str(gi.args(), &cmd_args.args.size);
+
+	return cmd_args.args.str;
+}
+
+// Save streams. The game can read and write its save files through these
+// instead of WASI, which costs a crossing and a syscall per fwrite. The
+// host side buffers generously, so most calls don't touch the disk.
+#define MAX_SAVE_FILES		8
+#define SAVE_FILE_BUFFER	(256 * 1024)
+
+typedef struct
+{
+	FILE				*fp;
+	char				*buffer;
+	wasm_ram_file_t		*ram;	// autosave kept in memory instead
+} save_file_t;
+
+static save_file_t save_files[MAX_SAVE_FILES];
+
+static struct
+{
+	uint32_t	calls;
+	uint64_t	bytes;
+} save_io_stats;
+
+static save_file_t *fetch_save_file(int32_t handle)
+{
+	if (handle < 1 || handle > MAX_SAVE_FILES || (!save_files[handle - 1].fp && !save_files[handle - 1].ram))
+		wasm_error("Invalid save file handle");
+
+	return &save_files[handle - 1];
+}
+
+static int32_t q2_save_open(wasm_exec_env_t env, const char *path, int32_t write)
+{
+	char native_path[MAX_INFO_STRING];
+
+	if (!q2_wasm_native_save_path(path, native_path, sizeof(native_path)))
+		return 0;
+
+	for (int32_t i = 0; i < MAX_SAVE_FILES; i++)
+	{
+		save_file_t *file = &save_files[i];
+
+		if (file->fp || file->ram)
+			continue;
+
+		if ((file->ram = q2_wasm_ram_open(native_path, write != 0)))
+			return i + 1;
+
+		if (!(file->fp = fopen(native_path, write ? "wb" : "rb")))
+			return 0;
+
+		file->buffer = (char *) gi.TagMalloc(SAVE_FILE_BUFFER, TAG_GAME);
+		setvbuf(file->fp, file->buffer, _IOFBF, SAVE_FILE_BUFFER);
+
+		return i + 1;
+	}
+
+	return 0;
+}
+
+static uint32_t q2_save_write(wasm_exec_env_t env, int32_t handle, const void *data, uint32_t size)
+{
+	save_file_t *file = fetch_save_file(handle);
+
+	save_io_stats.calls++;
+	save_io_stats.bytes += size;
+
+	if (file->ram)
+		return q2_wasm_ram_write(file->ram, data, size);
+
+	return (uint32_t) fwrite(data, 1, size, file->fp);
+}
+
+static uint32_t q2_save_read(wasm_exec_env_t env, int32_t handle, void *data, uint32_t size)
+{
+	save_file_t *file = fetch_save_file(handle);
+
+	save_io_stats.calls++;
+	save_io_stats.bytes += size;
+
+	if (file->ram)
+		return q2_wasm_ram_read(file->ram, data, size);
+
+	return (uint32_t) fread(data, 1, size, file->fp);
+}
+
+static int32_t q2_save_close(wasm_exec_env_t env, int32_t handle)
+{
+	save_file_t *file = fetch_save_file(handle);
+
+	if (file->ram)
+	{
+		q2_wasm_ram_close(file->ram);
+		file->ram = NULL;
+		return true;
+	}
+
+	const bool ok = !ferror(file->fp);
+
+	// fclose flushes, so the buffer has to stay around until after
+	const bool closed = fclose(file->fp) == 0;
+
+	gi.TagFree(file->buffer);
+	file->fp = NULL;
+	file->buffer = NULL;
+
+	return ok && closed;
+}
+
+// Closes any streams the game left open, such as after
+// an error in the middle of a save, so nothing leaks.
+void q2_wasm_close_save_files(void)
+{
+	for (int32_t i = 0; i < MAX_SAVE_FILES; i++)
+		if (save_files[i].fp || save_files[i].ram)
+			q2_save_close(NULL, i + 1);
+}
+
+// sys_wasmsavetimes; prints how long a save or load took, along with
+// how much went through the save streams, to compare against WASI.
+void q2_wasm_report_save_time(const char *what, uint64_t start)
+{
+	gi.dprintf("%s: %.2f ms, %u save stream calls, %u KiB\n", what, (wasm_time_nsec() - start) / 1000000.0,
+		save_io_stats.calls, (uint32_t) (save_io_stats.bytes / 1024));
+
+	save_io_stats.calls = 0;
+	save_io_stats.bytes = 0;
+}
+
+// Bridge tables that point into linear memory, for whole-instance saves.
+// Everything that points at native memory is rebuilt on load instead.
+void q2_wasm_write_image_tables(FILE *fp)
+{
+	uint32_t count = 0;
+
+	for (wasm_mapped_cvar_t *cvar = mapped_cvars; cvar; cvar = cvar->next)
+		count++;
+
+	fwrite(&count, sizeof(count), 1, fp);
+
+	for (wasm_mapped_cvar_t *cvar = mapped_cvars; cvar; cvar = cvar->next)
+	{
+		const uint32_t len = (uint32_t) strlen(cvar->native->name);
+
+		fwrite(&len, sizeof(len), 1, fp);
+		fwrite(cvar->native->name, 1, len, fp);
+		fwrite(&cvar->wasm_ptr, sizeof(cvar->wasm_ptr), 1, fp);
+		fwrite(&cvar->string_size, sizeof(cvar->string_size), 1, fp);
+		fwrite(&cvar->latched_string_size, sizeof(cvar->latched_string_size), 1, fp);
+	}
+
+	count = 0;
+
+	for (tagged_block_t *block = tagged_blocks; block; block = block->next)
+		count++;
+
+	fwrite(&count, sizeof(count), 1, fp);
+
+	for (tagged_block_t *block = tagged_blocks; block; block = block->next)
+	{
+		fwrite(&block->memory, sizeof(block->memory), 1, fp);
+		fwrite(&block->tag, sizeof(block->tag), 1, fp);
+	}
+}
+
+bool q2_wasm_read_image_tables(wasm_image_reader_t *r)
+{
+	uint32_t count;
+
+	// the old tables point at memory that was just replaced
+	while (mapped_cvars)
+	{
+		wasm_mapped_cvar_t *next = mapped_cvars->next;
+		gi.TagFree(mapped_cvars);
+		mapped_cvars = next;
+	}
+
+	while (tagged_blocks)
+	{
+		tagged_block_t *next = tagged_blocks->next;
+		gi.TagFree(tagged_blocks);
+		tagged_blocks = next;
+	}
+
+	cmd_args.argc = -1;
+	cmd_args.args.str = 0;
+
+	q2_wasm_clear_surface_cache();
+	q2_wasm_clear_index_cache();
+	q2_wasm_clear_configstrings();
+
+	if (!wasm_image_read(r, &count, sizeof(count)))
+		return false;
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		char name[MAX_INFO_STRING];
+		uint32_t len;
+		wasm_mapped_cvar_t *m = (wasm_mapped_cvar_t *) gi.TagMalloc(sizeof(wasm_mapped_cvar_t), TAG_GAME);
+
+		m->next = mapped_cvars;
+		mapped_cvars = m;
+
+		if (!wasm_image_read(r, &len, sizeof(len)) || len >= sizeof(name) ||
+			!wasm_image_read(r, name, len) ||
+			!wasm_image_read(r, &m->wasm_ptr, sizeof(m->wasm_ptr)) ||
+			!wasm_image_read(r, &m->string_size, sizeof(m->string_size)) ||
+			!wasm_image_read(r, &m->latched_string_size, sizeof(m->latched_string_size)) ||
+			!wasm_validate_addr(m->wasm_ptr, sizeof(wasm_cvar_t)))
+			return false;
+
+		name[len] = 0;
+
+		// the game may have registered it from a save in an older
+		// session, but it has to exist for the game's pointer to it
+		if (!(m->native = gi.cvar(name, NULL, 0)))
+			m->native = gi.cvar(name, "", 0);
+
+		// pick up the current values
+		update_mapped_cvar((wasm_cvar_t *) wasm_addr_to_native(m->wasm_ptr), m, qfalse);
+	}
+
+	if (!wasm_image_read(r, &count, sizeof(count)))
+		return false;
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		tagged_block_t *block = (tagged_block_t *) gi.TagMalloc(sizeof(tagged_block_t), TAG_GAME);
+
+		block->next = tagged_blocks;
+		tagged_blocks = block;
+
+		if (!wasm_image_read(r, &block->memory, sizeof(block->memory)) ||
+			!wasm_image_read(r, &block->tag, sizeof(block->tag)))
+			return false;
+
+		block->ptr = wasm_addr_to_native(block->memory);
+	}
+
+	return true;
 }
 
 static void q2_AddCommandString(wasm_exec_env_t env, const char *str)
@@ -872,10 +1908,33 @@ static NativeSymbol native_symbols[] = {
 	SYMBOL(modelindex, "($)i"),
 	SYMBOL(imageindex, "($)i"),
 	SYMBOL(soundindex, "($)i"),
-	SYMBOL(linkentity, "(*)"),
+	SYMBOL(precache_batch, "(*i)"),
 	SYMBOL(unlinkentity, "(*)"),
 	SYMBOL(setmodel, "(*$)"),
 	SYMBOL(Pmove, "(*)"),
+	SYMBOL(unicast, "(*i)"),
+	SYMBOL(unicast_mask, "(*~**)"),
+	SYMBOL(multicast, "(fffi)"),
+	SYMBOL(positioned_sound, "(fff*iifff)"),
+	SYMBOL(argc, "()i"),
+	SYMBOL(argv, "(i)i"),
+	SYMBOL(args, "()i"),
+	SYMBOL(AddCommandString, "($)"),
+	SYMBOL(AreasConnected, "(ii)i"),
+	SYMBOL(inPHS, "(ffffff)i"),
+	SYMBOL(inPVS, "(ffffff)i"),
+	SYMBOL(SetAreaPortalState, "(ii)"),
+	SYMBOL(DebugGraph, "(fi)"),
+	SYMBOL(GetDeferQueue, "()i"),
+	SYMBOL(FlushDeferQueue, "()"),
+	SYMBOL(save_open, "($i)i"),
+	SYMBOL(save_write, "(i*~)i"),
+	SYMBOL(save_read, "(i*~)i"),
+	SYMBOL(save_close, "(i)i")
+};
+
+static NativeSymbol hot_symbols[] = {
+	SYMBOL(linkentity, "(*)"),
 	SYMBOL(trace, "(ffffffffffff*i*)"),
 	SYMBOL(pointcontents, "(fff)i"),
 	SYMBOL(WriteAngle, "(f)"),
@@ -887,23 +1946,43 @@ static NativeSymbol native_symbols[] = {
 	SYMBOL(WritePosition, "(fff)"),
 	SYMBOL(WriteShort, "(i)"),
 	SYMBOL(WriteString, "($)"),
-	SYMBOL(unicast, "(*i)"),
-	SYMBOL(multicast, "(fffi)"),
+	SYMBOL(WriteMessage, "(*~)"),
 	SYMBOL(BoxEdicts, "(ffffff*ii)i"),
-	SYMBOL(sound, "(*iifff)"),
-	SYMBOL(positioned_sound, "(fff*iifff)"),
-	SYMBOL(argc, "()i"),
-	SYMBOL(argv, "(i)i"),
-	SYMBOL(args, "()i"),
-	SYMBOL(AddCommandString, "($)"),
-	SYMBOL(AreasConnected, "(ii)i"),
-	SYMBOL(inPHS, "(ffffff)i"),
-	SYMBOL(inPVS, "(ffffff)i"),
-	SYMBOL(SetAreaPortalState, "(ii)"),
-	SYMBOL(DebugGraph, "(fi)")
+	SYMBOL(sound, "(*iifff)")
 };
 
-int32_t RegisterApiNatives()
+// pointers are plain i32s here, so WAMR leaves them alone
+#define RAW_SYMBOL(name, sig) \
+	{ #name, (void *) q2_ ## name ## _raw, sig, NULL }
+
+static NativeSymbol hot_symbols_raw[] = {
+	RAW_SYMBOL(linkentity, "(i)"),
+	RAW_SYMBOL(trace, "(ffffffffffffiii)"),
+	RAW_SYMBOL(pointcontents, "(fff)i"),
+	RAW_SYMBOL(WriteAngle, "(f)"),
+	RAW_SYMBOL(WriteByte, "(i)"),
+	RAW_SYMBOL(WriteChar, "(i)"),
+	RAW_SYMBOL(WriteDir, "(fff)"),
+	RAW_SYMBOL(WriteFloat, "(f)"),
+	RAW_SYMBOL(WriteLong, "(i)"),
+	RAW_SYMBOL(WritePosition, "(fff)"),
+	RAW_SYMBOL(WriteShort, "(i)"),
+	RAW_SYMBOL(WriteString, "(i)"),
+	RAW_SYMBOL(WriteMessage, "(ii)"),
+	RAW_SYMBOL(BoxEdicts, "(ffffffiii)i"),
+	RAW_SYMBOL(sound, "(iiifff)")
+};
+
+int32_t RegisterApiNatives(bool raw_hot_imports, bool time_hot_imports)
 {
-	return wasm_runtime_register_natives("q2", native_symbols, lengthof(native_symbols));
+	hot_imports.raw = raw_hot_imports;
+	hot_imports.timed = time_hot_imports;
+
+	if (!wasm_runtime_register_natives("q2", native_symbols, lengthof(native_symbols)))
+		return false;
+
+	if (raw_hot_imports)
+		return wasm_runtime_register_natives_raw("q2", hot_symbols_raw, lengthof(hot_symbols_raw));
+
+	return wasm_runtime_register_natives("q2", hot_symbols, lengthof(hot_symbols));
 }
\ No newline at end of file
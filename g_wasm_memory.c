@@ -0,0 +1,540 @@
+/*
+Copyright (C) 1997-2001 Id Software, Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "g_main.h"
+#include "g_wasm.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+#endif
+
+// Runtime memory. WAMR gets all of its memory from the allocator below
+// instead of the system one. Blocks of a huge page or more, which is where
+// linear memory lives on builds without hardware bounds checks, get their
+// own mapping backed by huge pages: transparent ones (sys_wasmhugepages 1)
+// or explicit ones (2), which have to be set aside in the OS beforehand
+// and fall back to transparent ones if there are none. Builds with
+// hardware bounds checks reserve linear memory themselves, so there it's
+// only advised to use transparent huge pages once it's there.
+//
+// sys_wasmprefault 1 touches every page of linear memory as soon as it's
+// committed, so early frames don't take the faults; 2 also locks it in RAM.
+enum { HUGE_PAGE_SIZE = 2 * 1024 * 1024 };
+
+typedef enum
+{
+	HUGE_PAGES_OFF,
+	HUGE_PAGES_TRANSPARENT,
+	HUGE_PAGES_EXPLICIT,
+
+	HUGE_PAGES_NUM_MODES
+} huge_pages_t;
+
+static const char *const huge_pages_names[HUGE_PAGES_NUM_MODES] = { "off", "transparent", "explicit" };
+
+// in front of every block that comes from malloc; keeps it 16-byte aligned
+typedef struct
+{
+	uint64_t	size;		// bytes in the block
+	uint64_t	pad;
+} alloc_header_t;
+
+// Mapped blocks are kept in a table instead, so that the block starts
+// right at its mapping: a header in front would push linear memory 16
+// bytes past the huge page boundary the mapping is aligned to.
+typedef struct
+{
+	uint8_t		*data;
+	uint64_t	size;		// bytes in the block
+	uint64_t	mapped;		// bytes mapped for it
+} mapped_block_t;
+
+enum { MAX_MAPPED_BLOCKS = 64 };
+
+static struct
+{
+	huge_pages_t	huge_pages;
+	int32_t			prefault;
+	size_t			large_page_size;	// explicit huge pages, 0 if we can't have them
+	bool			explicit_failed, lock_failed;
+
+	mapped_block_t	mapped[MAX_MAPPED_BLOCKS];
+	uint64_t		mapped_blocks, mapped_bytes;
+
+	// the part of linear memory that's been advised and prefaulted
+	uint8_t			*prepared_base;
+	uint64_t		prepared_size;
+} runtime_memory;
+
+#ifdef _WIN32
+// large pages need SeLockMemoryPrivilege, which has to be granted to the
+// account and then enabled in the process
+static size_t enable_large_pages(void)
+{
+	HANDLE token;
+
+	if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+		return 0;
+
+	TOKEN_PRIVILEGES privileges = { 1 };
+	privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+
+	bool enabled = LookupPrivilegeValueA(NULL, "SeLockMemoryPrivilege", &privileges.Privileges[0].Luid) &&
+		AdjustTokenPrivileges(token, FALSE, &privileges, 0, NULL, NULL) && GetLastError() == ERROR_SUCCESS;
+
+	CloseHandle(token);
+
+	return enabled ? GetLargePageMinimum() : 0;
+}
+#endif
+
+static void *memory_map(uint64_t *size)
+{
+	*size = (*size + HUGE_PAGE_SIZE - 1) & ~(uint64_t) (HUGE_PAGE_SIZE - 1);
+
+#ifdef _WIN32
+	if (runtime_memory.huge_pages == HUGE_PAGES_EXPLICIT && runtime_memory.large_page_size)
+	{
+		const uint64_t large_size = (*size + runtime_memory.large_page_size - 1) / runtime_memory.large_page_size * runtime_memory.large_page_size;
+		void *data = VirtualAlloc(NULL, (SIZE_T) large_size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+
+		if (data)
+		{
+			*size = large_size;
+			return data;
+		}
+		else if (!runtime_memory.explicit_failed)
+		{
+			runtime_memory.explicit_failed = true;
+			gi.dprintf("Couldn't get large pages for WASM memory, using regular ones\n");
+		}
+	}
+
+	return VirtualAlloc(NULL, (SIZE_T) *size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+#ifdef MAP_HUGETLB
+	if (runtime_memory.huge_pages == HUGE_PAGES_EXPLICIT)
+	{
+		void *data = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+		if (data != MAP_FAILED)
+			return data;
+		else if (!runtime_memory.explicit_failed)
+		{
+			runtime_memory.explicit_failed = true;
+			gi.dprintf("Couldn't get explicit huge pages for WASM memory (see vm.nr_hugepages), using transparent ones\n");
+		}
+	}
+#endif
+
+	// over-map so the block can start on a huge page boundary; the kernel
+	// only backs aligned 2 MiB ranges with transparent huge pages
+	uint8_t *data = (uint8_t *) mmap(NULL, *size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (data == (uint8_t *) MAP_FAILED)
+		return NULL;
+
+	uint8_t *aligned = (uint8_t *) (((uintptr_t) data + HUGE_PAGE_SIZE - 1) & ~(uintptr_t) (HUGE_PAGE_SIZE - 1));
+
+	if (aligned != data)
+		munmap(data, aligned - data);
+
+	munmap(aligned + *size, (data + HUGE_PAGE_SIZE) - aligned);
+
+#ifdef MADV_HUGEPAGE
+	madvise(aligned, *size, MADV_HUGEPAGE);
+#endif
+
+	return aligned;
+#endif
+}
+
+static void memory_unmap(void *data, uint64_t size)
+{
+#ifdef _WIN32
+	VirtualFree(data, 0, MEM_RELEASE);
+#else
+	munmap(data, size);
+#endif
+}
+
+static mapped_block_t *find_mapped_block(const void *ptr)
+{
+	for (uint64_t i = 0; i < runtime_memory.mapped_blocks; i++)
+		if (runtime_memory.mapped[i].data == ptr)
+			return &runtime_memory.mapped[i];
+
+	return NULL;
+}
+
+// These have WAMR's default allocator signatures, without the user data
+// or usage arguments that WASM_MEM_ALLOC_WITH_USER_DATA and
+// WASM_MEM_ALLOC_WITH_USAGE add.
+static void *runtime_malloc(unsigned int size)
+{
+	if (runtime_memory.huge_pages != HUGE_PAGES_OFF && size >= HUGE_PAGE_SIZE &&
+		runtime_memory.mapped_blocks < MAX_MAPPED_BLOCKS)
+	{
+		uint64_t mapped = size;
+		uint8_t *data = (uint8_t *) memory_map(&mapped);
+
+		if (data)
+		{
+			runtime_memory.mapped[runtime_memory.mapped_blocks++] = (mapped_block_t) { data, size, mapped };
+			runtime_memory.mapped_bytes += mapped;
+			return data;
+		}
+	}
+
+	alloc_header_t *header = (alloc_header_t *) malloc(sizeof(alloc_header_t) + size);
+
+	if (!header)
+		return NULL;
+
+	header->size = size;
+	return header + 1;
+}
+
+static void runtime_free(void *ptr)
+{
+	if (!ptr)
+		return;
+
+	mapped_block_t *block = find_mapped_block(ptr);
+
+	if (!block)
+	{
+		free((alloc_header_t *) ptr - 1);
+		return;
+	}
+
+	runtime_memory.mapped_bytes -= block->mapped;
+	memory_unmap(block->data, block->mapped);
+
+	*block = runtime_memory.mapped[--runtime_memory.mapped_blocks];
+}
+
+static void *runtime_realloc(void *ptr, unsigned int size)
+{
+	if (!ptr)
+		return runtime_malloc(size);
+
+	mapped_block_t *block = find_mapped_block(ptr);
+	uint64_t old_size;
+
+	if (block)
+	{
+		// still fits in its mapping
+		if (size <= block->mapped)
+		{
+			block->size = size;
+			return ptr;
+		}
+
+		old_size = block->size;
+	}
+	else
+	{
+		alloc_header_t *header = (alloc_header_t *) ptr - 1;
+
+		// stays with malloc
+		if (runtime_memory.huge_pages == HUGE_PAGES_OFF || size < HUGE_PAGE_SIZE)
+		{
+			if (!(header = (alloc_header_t *) realloc(header, sizeof(alloc_header_t) + size)))
+				return NULL;
+
+			header->size = size;
+			return header + 1;
+		}
+
+		old_size = header->size;
+	}
+
+	void *moved = runtime_malloc(size);
+
+	if (!moved)
+		return NULL;
+
+	memcpy(moved, ptr, (size_t) (old_size < size ? old_size : size));
+	runtime_free(ptr);
+	return moved;
+}
+
+/*
+============
+q2_wasm_init_runtime_memory
+
+Fills in the allocator part of the runtime's init args.
+============
+*/
+void q2_wasm_init_runtime_memory(RuntimeInitArgs *init_args, int32_t huge_pages, int32_t prefault)
+{
+	runtime_memory.huge_pages = (huge_pages_t) (huge_pages < HUGE_PAGES_OFF ? HUGE_PAGES_OFF : huge_pages > HUGE_PAGES_EXPLICIT ? HUGE_PAGES_EXPLICIT : huge_pages);
+	runtime_memory.prefault = prefault;
+
+#ifdef _WIN32
+	if (runtime_memory.huge_pages == HUGE_PAGES_EXPLICIT && !(runtime_memory.large_page_size = enable_large_pages()))
+		gi.dprintf("Large pages need the \"Lock pages in memory\" right, using regular ones\n");
+#else
+	runtime_memory.large_page_size = HUGE_PAGE_SIZE;
+#endif
+
+	init_args->mem_alloc_type = Alloc_With_Allocator;
+	init_args->mem_alloc_option.allocator.malloc_func = (void *) runtime_malloc;
+	init_args->mem_alloc_option.allocator.realloc_func = (void *) runtime_realloc;
+	init_args->mem_alloc_option.allocator.free_func = (void *) runtime_free;
+}
+
+// advises, prefaults and locks a newly committed part of linear memory
+static void prepare_memory(uint8_t *data, uint64_t size)
+{
+#ifdef MADV_HUGEPAGE
+	if (runtime_memory.huge_pages != HUGE_PAGES_OFF)
+	{
+		const uintptr_t page_size = (uintptr_t) sysconf(_SC_PAGESIZE);
+		const uintptr_t start = (uintptr_t) data & ~(page_size - 1);
+
+		madvise((void *) start, (uintptr_t) data + size - start, MADV_HUGEPAGE);
+	}
+#endif
+
+	if (runtime_memory.prefault >= 2 && !runtime_memory.lock_failed)
+	{
+#ifdef _WIN32
+		SIZE_T min_set, max_set;
+
+		if (GetProcessWorkingSetSize(GetCurrentProcess(), &min_set, &max_set))
+			SetProcessWorkingSetSize(GetCurrentProcess(), min_set + (SIZE_T) size, max_set + (SIZE_T) size);
+
+		runtime_memory.lock_failed = !VirtualLock(data, (SIZE_T) size);
+#else
+		runtime_memory.lock_failed = mlock(data, size) != 0;
+#endif
+
+		if (runtime_memory.lock_failed)
+			gi.dprintf("Couldn't lock WASM memory in RAM, only prefaulting it\n");
+	}
+
+	// writing is what gets a page of its own; reading would only map the
+	// shared zero page. This can run from inside an import, while the
+	// module is in the middle of a call, but nothing else runs on linear
+	// memory meanwhile and each write stores back the value just read.
+	if (runtime_memory.prefault >= 1)
+		for (volatile uint8_t *p = data; p < data + size; p += 4096)
+			*p = *p;
+}
+
+// called by wasm_sync_memory whenever linear memory has grown or moved
+void q2_wasm_memory_grown(void)
+{
+	if (runtime_memory.huge_pages == HUGE_PAGES_OFF && !runtime_memory.prefault)
+		return;
+
+	if (wasm.memory_base != runtime_memory.prepared_base)
+	{
+		runtime_memory.prepared_base = wasm.memory_base;
+		runtime_memory.prepared_size = 0;
+	}
+
+	if (wasm.memory_size <= runtime_memory.prepared_size)
+		return;
+
+	prepare_memory(wasm.memory_base + runtime_memory.prepared_size, wasm.memory_size - runtime_memory.prepared_size);
+	runtime_memory.prepared_size = wasm.memory_size;
+}
+
+void q2_wasm_print_memory_stats(void)
+{
+	gi.dprintf("runtime memory: huge pages %s, prefault %i, %llu mapped blocks (%.1f MiB), linear memory %.1f MiB\n",
+		huge_pages_names[runtime_memory.huge_pages], runtime_memory.prefault, (unsigned long long) runtime_memory.mapped_blocks,
+		runtime_memory.mapped_bytes / 1048576.0, wasm.memory_size / 1048576.0);
+}
+
+// sv wasm_framebench [frames]: times the next frames the server runs, and
+// counts the dTLB misses and page faults they take, to compare the
+// sys_wasmhugepages and sys_wasmprefault settings with each other.
+static struct
+{
+	int32_t		frames, count;	// to record, recorded so far
+	uint32_t	*nsec;
+	uint64_t	start, faults_start, faults;
+#ifdef __linux__
+	int			tlb_fd;
+#endif
+} frame_bench;
+
+static uint64_t page_faults(void)
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+
+	return GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)) ? counters.PageFaultCount : 0;
+#else
+	struct rusage usage;
+
+	return getrusage(RUSAGE_SELF, &usage) == 0 ? (uint64_t) usage.ru_minflt + usage.ru_majflt : 0;
+#endif
+}
+
+static void close_tlb_counter(void)
+{
+#ifdef __linux__
+	if (frame_bench.tlb_fd > 0)
+		close(frame_bench.tlb_fd);
+
+	frame_bench.tlb_fd = 0;
+#endif
+}
+
+void q2_wasm_frame_bench(void)
+{
+	int32_t frames = gi.argc() > 2 ? atoi(gi.argv(2)) : 600;
+
+	if (frames < 1)
+		frames = 1;
+	else if (frames > 1000000)
+		frames = 1000000;
+
+	if (frame_bench.nsec)
+		gi.TagFree(frame_bench.nsec);
+
+	close_tlb_counter();
+
+	frame_bench.nsec = (uint32_t *) gi.TagMalloc(sizeof(uint32_t) * frames, TAG_GAME);
+	frame_bench.frames = frames;
+	frame_bench.count = 0;
+	frame_bench.faults = 0;
+
+#ifdef __linux__
+	// user-space data TLB load misses, only counted while a frame runs
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	const long fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+	frame_bench.tlb_fd = fd > 0 ? (int) fd : 0;
+#endif
+
+	gi.dprintf("Timing the next %i frames\n", frames);
+}
+
+void q2_wasm_frame_begin(void)
+{
+	if (!frame_bench.frames)
+		return;
+
+	frame_bench.faults_start = page_faults();
+
+#ifdef __linux__
+	if (frame_bench.tlb_fd)
+		ioctl(frame_bench.tlb_fd, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+
+	frame_bench.start = wasm_time_nsec();
+}
+
+static int compare_nsec(const void *a, const void *b)
+{
+	const uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+	return (x > y) - (x < y);
+}
+
+static void report_frame_bench(void)
+{
+	const int32_t count = frame_bench.count;
+	uint64_t total = 0;
+
+	for (int32_t i = 0; i < count; i++)
+		total += frame_bench.nsec[i];
+
+	qsort(frame_bench.nsec, count, sizeof(uint32_t), compare_nsec);
+
+	gi.dprintf("frame bench: %i frames, huge pages %s, prefault %i\n", count,
+		huge_pages_names[runtime_memory.huge_pages], runtime_memory.prefault);
+	gi.dprintf("  frame time: %.3f ms mean, %.3f ms p50, %.3f ms p99, %.3f ms max\n", total / 1e6 / count,
+		frame_bench.nsec[count / 2] / 1e6, frame_bench.nsec[(int32_t) (count * 0.99)] / 1e6, frame_bench.nsec[count - 1] / 1e6);
+	gi.dprintf("  page faults: %.2f per frame\n", (double) frame_bench.faults / count);
+
+#ifdef __linux__
+	uint64_t tlb_misses;
+
+	if (frame_bench.tlb_fd && read(frame_bench.tlb_fd, &tlb_misses, sizeof(tlb_misses)) == sizeof(tlb_misses))
+	{
+		gi.dprintf("  dTLB load misses: %.1f per frame\n", (double) tlb_misses / count);
+		return;
+	}
+#endif
+
+	gi.dprintf("  dTLB load misses: not available here\n");
+}
+
+void q2_wasm_frame_end(void)
+{
+	if (!frame_bench.frames)
+		return;
+
+	const uint64_t nsec = wasm_time_nsec() - frame_bench.start;
+
+#ifdef __linux__
+	if (frame_bench.tlb_fd)
+		ioctl(frame_bench.tlb_fd, PERF_EVENT_IOC_DISABLE, 0);
+#endif
+
+	frame_bench.faults += page_faults() - frame_bench.faults_start;
+	frame_bench.nsec[frame_bench.count++] = nsec > UINT32_MAX ? UINT32_MAX : (uint32_t) nsec;
+
+	if (frame_bench.count < frame_bench.frames)
+		return;
+
+	report_frame_bench();
+
+	gi.TagFree(frame_bench.nsec);
+	close_tlb_counter();
+	memset(&frame_bench, 0, sizeof(frame_bench));
+}
+
+void q2_wasm_shutdown_runtime_memory(void)
+{
+	// the buffer goes with TAG_GAME
+	close_tlb_counter();
+	memset(&frame_bench, 0, sizeof(frame_bench));
+
+	runtime_memory.prepared_base = NULL;
+	runtime_memory.prepared_size = 0;
+}
@@ -0,0 +1,214 @@
+/*
+Copyright (C) 1997-2001 Id Software, Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+#include "g_main.h"
+#include "g_wasm.h"
+
+// Small bridge-owned objects that live in WASM memory (cvar structs and
+// their strings) are carved out of large chunks instead of being allocated
+// one at a time from the module heap. Blocks are rounded up to a size class,
+// and freed blocks are kept on a per-class free list for re-use. The free
+// list links are stored inside of the freed blocks themselves.
+#define POOL_CHUNK_SIZE		16384
+#define POOL_MIN_CLASS_BITS	4
+#define POOL_NUM_CLASSES	7 // 16 -> 1024
+
+typedef struct
+{
+	wasm_addr_t	free_lists[POOL_NUM_CLASSES];
+
+	// current chunk we're carving from
+	wasm_addr_t	chunk_pos, chunk_end;
+} wasm_pool_t;
+
+static wasm_pool_t pool;
+
+static inline int32_t pool_size_class(uint32_t size)
+{
+	int32_t c = 0;
+
+	while (size > (1u << (c + POOL_MIN_CLASS_BITS)))
+		c++;
+
+	return c;
+}
+
+static inline uint32_t pool_class_size(int32_t c)
+{
+	return 1u << (c + POOL_MIN_CLASS_BITS);
+}
+
+wasm_addr_t wasm_pool_alloc(uint32_t *size, void **native)
+{
+	const int32_t c = pool_size_class(*size);
+	wasm_addr_t addr;
+
+	// too big for the pool; these are rare enough
+	// to just go to the module heap directly.
+	if (c >= POOL_NUM_CLASSES)
+	{
+		addr = wasm_module_malloc(*size, native);
+
+		if (!addr)
+			wasm_error("Out of WASM memory");
+
+		return addr;
+	}
+
+	*size = pool_class_size(c);
+
+	if ((addr = pool.free_lists[c]))
+	{
+		*native = wasm_addr_to_native(addr);
+		pool.free_lists[c] = *(wasm_addr_t *) *native;
+		return addr;
+	}
+
+	if (pool.chunk_end - pool.chunk_pos < *size)
+	{
+		// leftover tail of the old chunk gets split up into the
+		// free lists so it isn't wasted
+		for (int32_t i = c - 1; i >= 0; i--)
+		{
+			const uint32_t class_size = pool_class_size(i);
+
+			while (pool.chunk_end - pool.chunk_pos >= class_size)
+			{
+				*(wasm_addr_t *) wasm_addr_to_native(pool.chunk_pos) = pool.free_lists[i];
+				pool.free_lists[i] = pool.chunk_pos;
+				pool.chunk_pos += class_size;
+			}
+		}
+
+		pool.chunk_pos = wasm_module_malloc(POOL_CHUNK_SIZE, NULL);
+
+		if (!pool.chunk_pos)
+			wasm_error("Out of WASM memory");
+
+		pool.chunk_end = pool.chunk_pos + POOL_CHUNK_SIZE;
+	}
+
+	addr = pool.chunk_pos;
+	pool.chunk_pos += *size;
+	*native = wasm_addr_to_native(addr);
+
+	return addr;
+}
+
+void wasm_pool_free(wasm_addr_t addr, uint32_t size)
+{
+	if (!addr)
+		return;
+
+	const int32_t c = pool_size_class(size);
+
+	if (c >= POOL_NUM_CLASSES)
+	{
+		wasm_runtime_module_free(wasm.module_inst, addr);
+		return;
+	}
+
+	*(wasm_addr_t *) wasm_addr_to_native(addr) = pool.free_lists[c];
+	pool.free_lists[c] = addr;
+}
+
+wasm_string_t wasm_pool_dup_str(const char *str, uint32_t *size)
+{
+	void *native;
+
+	*size = (uint32_t) strlen(str) + 1;
+
+	const wasm_string_t s = wasm_pool_alloc(size, &native);
+
+	memcpy(native, str, strlen(str) + 1);
+
+	return s;
+}
+
+// Large host -> guest strings that only need to live until the next time
+// they're sent (the entity string for SpawnEntities, mainly) are copied
+// into a single region that is kept around and only grows, instead of
+// being allocated and freed from the module heap every time.
+#define STAGING_GRANULARITY	65536
+
+typedef struct
+{
+	wasm_addr_t	base;
+	uint32_t	size, pos;
+} wasm_staging_t;
+
+static wasm_staging_t staging;
+
+void wasm_staging_begin(uint32_t size)
+{
+	staging.pos = 0;
+
+	if (size <= staging.size)
+		return;
+
+	if (staging.base)
+		wasm_runtime_module_free(wasm.module_inst, staging.base);
+
+	staging.size = (size + STAGING_GRANULARITY - 1) & ~(STAGING_GRANULARITY - 1);
+	staging.base = wasm_module_malloc(staging.size, NULL);
+
+	if (!staging.base)
+	{
+		staging.size = 0;
+		wasm_error("Out of WASM memory");
+	}
+}
+
+wasm_string_t wasm_staging_dup_str(const char *str)
+{
+	const uint32_t len = (uint32_t) strlen(str) + 1;
+
+	if (staging.size - staging.pos < len)
+		wasm_error("Staging region overflow");
+
+	const wasm_string_t s = staging.base + staging.pos;
+
+	memcpy(wasm_addr_to_native(s), str, len);
+	staging.pos += len;
+
+	return s;
+}
+
+// the pool and staging region live in linear memory, so whole-instance
+// saves only need to carry over where we were in them
+void wasm_pool_write_image(FILE *fp)
+{
+	fwrite(&pool, sizeof(pool), 1, fp);
+	fwrite(&staging, sizeof(staging), 1, fp);
+}
+
+bool wasm_pool_read_image(wasm_image_reader_t *r)
+{
+	return wasm_image_read(r, &pool, sizeof(pool)) &&
+		wasm_image_read(r, &staging, sizeof(staging));
+}
+
+void wasm_pool_shutdown(void)
+{
+	// chunks are owned by the module instance, so they
+	// go away with it; we just need to forget about them.
+	memset(&pool, 0, sizeof(pool));
+	memset(&staging, 0, sizeof(staging));
+}
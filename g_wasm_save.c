@@ -0,0 +1,1795 @@
+/*
+Copyright (C) 1997-2001 Id Software, Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+#include <stdio.h>
+
+#include "g_main.h"
+#include "g_wasm.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <process.h>
+#else
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
+
+// In-memory store for autosaves. Levels written during an autosave through
+// the save streams are kept in memory and written out by a background
+// thread, so level transitions don't wait on the disk. The engine checks
+// for the file on disk before it asks for a level to be read, so if there
+// isn't one yet an empty file is created right away; the contents are read
+// from memory until the store is dropped.
+//
+// The thread writes to a .tmp next to the file, and only the main thread
+// renames it over the file, between the engine's own calls. That way the
+// engine never copies a half-written save, and a level written out after
+// the engine has copied a loaded save over the directory is thrown away
+// instead of clobbering it.
+//
+// An autosave's WriteGame goes to the store as well, so a level change
+// never waits on the disk. The engine copies the current directory to the
+// autosave slot as soon as WriteGame returns, which gets whatever was on
+// disk at that point; so everything in the store is also written out to
+// the slot afterwards, over what the engine copied there.
+#ifdef KMQUAKE2_ENGINE_MOD
+#define RAM_AUTOSAVE_SLOT	"kmq2save0"
+#else
+#define RAM_AUTOSAVE_SLOT	"save0"
+#endif
+
+typedef struct ram_save_s
+{
+	char		path[MAX_INFO_STRING];
+	uint8_t		*data;
+	size_t		size, alloc;
+
+	bool		open;		// being written by the game
+	bool		dirty;		// waiting for the flush thread
+	bool		flushing;	// being written out by the flush thread
+	bool		written;	// in the .tmp, waiting to be renamed over path
+	bool		placeholder;	// path is an empty file we made
+
+	// the autosave slot's copy, if it's still to be written,
+	// and whether it's in its .tmp waiting to be renamed
+	char		mirror[MAX_INFO_STRING];
+	bool		mirror_written;
+
+	struct ram_save_s	*next;
+} ram_save_t;
+
+struct wasm_ram_file_s
+{
+	ram_save_t	*save;
+	size_t		pos;
+	bool		write;
+};
+
+static struct
+{
+	bool		enabled, started, quit;
+	bool		autosave;	// inside of an autosave's WriteLevel or WriteGame
+
+	ram_save_t	*saves;
+
+#ifdef _WIN32
+	SRWLOCK				lock;
+	CONDITION_VARIABLE	work, done;
+	HANDLE				thread;
+#else
+	pthread_mutex_t		lock;
+	pthread_cond_t		work, done;
+	pthread_t			thread;
+#endif
+} ram_saves;
+
+// Background level saves. The process is forked at the save point, which
+// gives the child a copy-on-write snapshot of linear memory (and everything
+// else); the child runs the game's serializer and exits, while the server
+// carries on with the live instance. Only POSIX systems can do this, so
+// on Windows saves always happen synchronously.
+//
+// The child writes to a .tmp next to the save, which is only renamed into
+// place when the parent reaps it from one of the game's own calls. The
+// engine copies a loaded save over the directory, or wipes it for a new
+// map, before it calls into the game at all; so a save still running then
+// is thrown away by ShutdownGame, or by a SpawnEntities that didn't come
+// straight after the WriteLevel that started it, instead of landing on
+// top of what the engine put there.
+//
+// Only the thread that called fork() exists in the child, so a lock some
+// other thread held stays locked there for good. Background saves are
+// therefore refused when the bridge or WAMR run threads of their own: the
+// autosave flush thread, or the JIT's compile threads.
+static struct
+{
+	bool		enabled;
+
+#ifndef _WIN32
+	pid_t		pid;
+	char		filename[MAX_INFO_STRING];
+	uint64_t	start;
+	bool		fresh;		// no frame has run since it was started
+#endif
+} async_save;
+
+#ifndef _WIN32
+// The child shares the engine's console and log file, so anything
+// the game prints while saving is dropped, and errors just end it.
+static void child_print(const char *fmt, ...)
+{
+	(void) fmt;
+}
+
+static void child_cprint(edict_t *ent, print_level_t printlevel, const char *fmt, ...)
+{
+	(void) ent;
+	(void) printlevel;
+	(void) fmt;
+}
+
+static void child_bprint(print_level_t printlevel, const char *fmt, ...)
+{
+	(void) printlevel;
+	(void) fmt;
+}
+
+static void child_centerprint(edict_t *ent, const char *fmt, ...)
+{
+	(void) ent;
+	(void) fmt;
+}
+
+static void child_error(const char *fmt, ...)
+{
+	(void) fmt;
+	_exit(1);
+}
+#endif
+
+// other_threads is whether the runtime was set up to run threads
+// besides the main one; see above.
+void q2_wasm_init_async_save(bool enabled, bool other_threads)
+{
+#ifdef _WIN32
+	if (enabled)
+		gi.dprintf("sys_wasmasyncsave is not supported on this platform\n");
+
+	async_save.enabled = false;
+#else
+	if (enabled && (other_threads || ram_saves.started))
+	{
+		gi.dprintf("sys_wasmasyncsave can't be used with sys_wasmramautosaves or a JIT mode that compiles in the background; disabled\n");
+		enabled = false;
+	}
+
+	async_save.enabled = enabled;
+#endif
+}
+
+#ifndef _WIN32
+static void async_temp_path(char *path, size_t path_size)
+{
+	snprintf(path, path_size, "%s.tmp", async_save.filename);
+}
+
+// waits for the save in flight, if any, and puts its file in place
+// if keep is set; otherwise it's deleted.
+static void async_finish(bool wait, bool keep)
+{
+	if (!async_save.pid)
+		return;
+
+	int status;
+	const pid_t r = waitpid(async_save.pid, &status, wait ? 0 : WNOHANG);
+
+	if (r == 0)
+		return;
+
+	char temp_path[MAX_INFO_STRING + 4];
+	async_temp_path(temp_path, sizeof(temp_path));
+
+	if (r != async_save.pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	{
+		remove(temp_path);
+		gi.dprintf("WARNING: background save of %s failed\n", async_save.filename);
+	}
+	else if (!keep)
+		remove(temp_path);
+	else if (rename(temp_path, async_save.filename) == 0)
+		gi.dprintf("Saved %s in background (%u ms)\n", async_save.filename, (uint32_t) ((wasm_time_nsec() - async_save.start) / 1000000));
+	else
+		gi.dprintf("WARNING: couldn't move background save of %s into place\n", async_save.filename);
+
+	async_save.pid = 0;
+}
+#endif
+
+// Reaps a finished background save; if wait is set, blocks
+// until it's done. Safe to call when nothing is in flight.
+void q2_wasm_join_save(bool wait)
+{
+#ifndef _WIN32
+	async_finish(wait, true);
+#endif
+}
+
+// The engine may have replaced or wiped the save directory since the save
+// in flight was started; see above. Only a spawn right after the level
+// change that started it keeps it.
+void q2_wasm_save_level_changed(void)
+{
+#ifndef _WIN32
+	if (async_save.pid && !async_save.fresh)
+		async_finish(true, false);
+#endif
+}
+
+void q2_wasm_save_end_frame(void)
+{
+#ifndef _WIN32
+	async_save.fresh = false;
+	async_finish(false, true);
+#endif
+}
+
+// drops anything still being saved; see above
+void q2_wasm_shutdown_async_save(void)
+{
+#ifndef _WIN32
+	async_finish(true, false);
+#endif
+}
+
+// Runs func with args in a forked child if background saves are on. func
+// has to take the save's path from wasm_buffers()->filename, where the
+// child points it at the .tmp. Returns false if the caller has to run
+// it itself.
+bool q2_wasm_async_save(wasm_function_inst_t func, uint32_t *args, size_t num_args, const char *filename)
+{
+#ifdef _WIN32
+	return false;
+#else
+	if (!async_save.enabled)
+		return false;
+
+	// only one in flight at a time; the engine may be about to
+	// overwrite the file the last one is writing to
+	q2_wasm_join_save(true);
+
+	// don't let buffered output get written out twice
+	fflush(NULL);
+
+	const pid_t pid = fork();
+
+	if (pid < 0)
+	{
+		gi.dprintf("WARNING: couldn't fork for background save, saving now\n");
+		return false;
+	}
+
+	if (pid == 0)
+	{
+		// a ctrl-c meant for the server shouldn't cut the save short
+		signal(SIGINT, SIG_IGN);
+
+		// the RAM store and its flush thread stay with the parent,
+		// so the child has to write straight to disk
+		ram_saves.enabled = false;
+
+		gi.dprintf = child_print;
+		gi.cprintf = child_cprint;
+		gi.bprintf = child_bprint;
+		gi.centerprintf = child_centerprint;
+		gi.error = child_error;
+
+		wasm_buffers_t *buffers = wasm_buffers();
+		const size_t length = strlen(buffers->filename);
+
+		if (length + sizeof(".tmp") > sizeof(buffers->filename))
+			_exit(1);
+
+		memcpy(buffers->filename + length, ".tmp", sizeof(".tmp"));
+
+		wasm_call_args(func, args, num_args);
+
+		_exit(0);
+	}
+
+	async_save.pid = pid;
+	async_save.start = wasm_time_nsec();
+	async_save.fresh = true;
+	snprintf(async_save.filename, sizeof(async_save.filename), "%s", filename);
+
+	return true;
+#endif
+}
+
+// Whole-instance saves. Since everything the game has lives in linear
+// memory and is addressed by offset, an image of it plus the few bridge
+// tables that point into it is a complete save that can be put back with
+// a memcpy. Pages that are all zero are left out of the file.
+//
+// WriteGame writes the image instead of calling the game's serializer.
+// WriteLevel still goes through the game; a level file on its own has to
+// be loadable on top of a different game state when revisiting a level.
+// If the level was written as part of the same save, though, the image
+// already has it, and ReadLevel of that file restores the image again
+// instead (SpawnEntities has run over it in between).
+//
+// Most of memory doesn't change from one save to the next, so images are
+// deltas against a copy of memory taken by an earlier save. That copy is
+// written out once as wasm_base.sav next to the save, and every image
+// after it only has the blocks that differ. The base is kept across level
+// changes, and only retaken once a delta would cover over half of the
+// memory in use, so autosaves on each new level don't rewrite it. The name
+// matches the engine's *.sav pattern, so it's copied along with the save
+// directory. Level files get their own deltas; see below.
+//
+// WAMR keeps its own heap's bookkeeping outside of linear memory, so this
+// only works when the module brings its own malloc/free for the bridge to
+// use; that's sys_wasmheapsize 0 with a module exporting both.
+#define IMAGE_MAGIC		"WIMG"
+#define IMAGE_VERSION	2
+#define IMAGE_BLOCK		4096
+#define IMAGE_BASE_NAME	"wasm_base.sav"
+
+typedef enum
+{
+	IMAGE_FULL,		// every non-empty block
+	IMAGE_BASE,		// memory as of the save that took it; no tables
+	IMAGE_DELTA		// blocks that differ from base_id's memory
+} wasm_image_kind_t;
+
+typedef struct
+{
+	char		magic[4];
+	uint32_t	version;
+	uint32_t	kind;		// wasm_image_kind_t
+	uint32_t	memory_size;
+	uint64_t	module_hash;
+	uint64_t	base_id;	// the base this is, or is a delta of
+
+	// bridge allocations that the image's heap knows about
+	wasm_addr_t	buffers_addr;
+	wasm_addr_t	defer_queue;
+
+	// level file written together with this image, if any
+	char		level[MAX_INFO_STRING];
+} wasm_image_header_t;
+
+static struct
+{
+	bool		supported, enabled;
+	uint64_t	module_hash;
+
+	// last level written since the world last changed
+	char		level_written[MAX_INFO_STRING];
+
+	// image kept after ReadGame for the ReadLevel that follows; the
+	// engine spawns the map and runs two frames in between
+	uint8_t		*stash;
+	size_t		stash_size;
+	bool		stash_spawned;
+
+	// memory as of the save that took the base
+	uint8_t		*base;
+	uint32_t	base_size, base_alloc;
+	uint64_t	base_id, num_bases;
+} image_save;
+
+static uint64_t image_module_hash(void)
+{
+	uint64_t hash = 14695981039346656037ull;
+
+	for (uint32_t i = 0; i < wasm.assembly_size; i++)
+		hash = (hash ^ wasm.assembly[i]) * 1099511628211ull;
+
+	return hash;
+}
+
+void q2_wasm_init_image_saves(bool enabled, uint32_t heap_size)
+{
+	image_save.supported = !heap_size &&
+		wasm_runtime_lookup_function(wasm.module_inst, "malloc", NULL) &&
+		wasm_runtime_lookup_function(wasm.module_inst, "free", NULL);
+	image_save.enabled = enabled && image_save.supported;
+
+	if (enabled && !image_save.supported)
+		gi.dprintf("sys_wasmimagesaves needs sys_wasmheapsize 0 and a module that exports malloc and free; disabled\n");
+
+	if (image_save.supported)
+		image_save.module_hash = image_module_hash();
+}
+
+bool q2_wasm_image_saves_enabled(void)
+{
+	return image_save.enabled;
+}
+
+static uint8_t *image_memory(uint32_t *size)
+{
+	wasm_memory_inst_t memory = wasm_runtime_get_default_memory(wasm.module_inst);
+
+	*size = (uint32_t) (wasm_memory_get_cur_page_count(memory) * wasm_memory_get_bytes_per_page(memory));
+
+	return (uint8_t *) wasm_memory_get_base_address(memory);
+}
+
+static bool image_block_empty(const uint8_t *block, uint32_t size)
+{
+	const uint64_t *p = (const uint64_t *) block;
+
+	for (uint32_t i = 0; i < size / sizeof(uint64_t); i++)
+		if (p[i])
+			return false;
+
+	return true;
+}
+
+// blocks that have to go in: anything non-empty, or for
+// a delta, anything that isn't the same as in the base
+static bool image_block_wanted(const uint8_t *memory, uint32_t offset, const uint8_t *base, uint32_t base_size)
+{
+	if (base && offset < base_size)
+		return memcmp(memory + offset, base + offset, IMAGE_BLOCK) != 0;
+
+	return !image_block_empty(memory + offset, IMAGE_BLOCK);
+}
+
+// runs of wanted blocks, as offset + length, ending with a 0 length
+static void image_write_runs(FILE *fp, const uint8_t *memory, uint32_t memory_size, const uint8_t *base, uint32_t base_size)
+{
+	for (uint32_t offset = 0; offset < memory_size; )
+	{
+		if (!image_block_wanted(memory, offset, base, base_size))
+		{
+			offset += IMAGE_BLOCK;
+			continue;
+		}
+
+		uint32_t end = offset + IMAGE_BLOCK;
+
+		while (end < memory_size && image_block_wanted(memory, end, base, base_size))
+			end += IMAGE_BLOCK;
+
+		const uint32_t run[2] = { offset, end - offset };
+
+		fwrite(run, sizeof(run), 1, fp);
+		fwrite(memory + offset, 1, end - offset, fp);
+
+		offset = end;
+	}
+
+	const uint32_t run[2] = { 0, 0 };
+	fwrite(run, sizeof(run), 1, fp);
+}
+
+static bool image_read_runs(wasm_image_reader_t *r, uint8_t *memory, uint32_t memory_size)
+{
+	for (;;)
+	{
+		uint32_t run[2];
+
+		if (!wasm_image_read(r, run, sizeof(run)))
+			return false;
+
+		if (!run[1])
+			return true;
+
+		if (run[0] > memory_size || run[1] > memory_size - run[0] ||
+			!wasm_image_read(r, memory + run[0], run[1]))
+			return false;
+	}
+}
+
+static void image_base_path(const char *filename, char *path, size_t path_size)
+{
+	const char *slash = strrchr(filename, '/');
+	const int dir_length = slash ? (int) (slash + 1 - filename) : 0;
+
+	snprintf(path, path_size, "%.*s%s", dir_length, filename, IMAGE_BASE_NAME);
+}
+
+// whether a delta against the current base is still worth it
+static bool image_base_useful(const uint8_t *memory, uint32_t memory_size)
+{
+	if (!image_save.base)
+		return false;
+
+	uint32_t used = 0, changed = 0;
+
+	for (uint32_t offset = 0; offset < memory_size; offset += IMAGE_BLOCK)
+	{
+		if (!image_block_empty(memory + offset, IMAGE_BLOCK))
+			used++;
+
+		if (image_block_wanted(memory, offset, image_save.base, image_save.base_size))
+			changed++;
+	}
+
+	return changed * 2 <= used;
+}
+
+static void image_capture_base(const uint8_t *memory, uint32_t memory_size)
+{
+	if (image_save.base_alloc < memory_size)
+	{
+		if (image_save.base)
+			gi.TagFree(image_save.base);
+
+		image_save.base = (uint8_t *) gi.TagMalloc((int32_t) memory_size, TAG_GAME);
+		image_save.base_alloc = memory_size;
+	}
+
+	memcpy(image_save.base, memory, memory_size);
+	image_save.base_size = memory_size;
+
+	// only has to tell bases apart, but shouldn't repeat across sessions
+	image_save.base_id = (image_save.module_hash ^ wasm_time_nsec()) * 1099511628211ull + ++image_save.num_bases;
+}
+
+static bool image_read_header(FILE *fp, wasm_image_header_t *header)
+{
+	return fread(header, sizeof(*header), 1, fp) == 1 &&
+		!memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) &&
+		header->version == IMAGE_VERSION &&
+		header->module_hash == image_save.module_hash;
+}
+
+// writes the current base next to filename, unless it's already there
+static void image_write_base(const char *filename)
+{
+	char path[MAX_INFO_STRING];
+	wasm_image_header_t header;
+
+	image_base_path(filename, path, sizeof(path));
+
+	FILE *fp = fopen(path, "rb");
+
+	if (fp)
+	{
+		const bool current = image_read_header(fp, &header) &&
+			header.kind == IMAGE_BASE && header.base_id == image_save.base_id;
+
+		fclose(fp);
+
+		if (current)
+			return;
+	}
+
+	if (!(fp = fopen(path, "wb")))
+		wasm_error("Couldn't open save image base for writing");
+
+	header = (wasm_image_header_t) {
+		.magic = IMAGE_MAGIC,
+		.version = IMAGE_VERSION,
+		.kind = IMAGE_BASE,
+		.memory_size = image_save.base_size,
+		.module_hash = image_save.module_hash,
+		.base_id = image_save.base_id
+	};
+
+	fwrite(&header, sizeof(header), 1, fp);
+	image_write_runs(fp, image_save.base, image_save.base_size, NULL, 0);
+
+	if (ferror(fp))
+	{
+		fclose(fp);
+		wasm_error("Couldn't write save image base");
+	}
+
+	fclose(fp);
+}
+
+void q2_wasm_write_image(const char *filename)
+{
+	uint32_t memory_size;
+	const uint8_t *memory = image_memory(&memory_size);
+
+	if (!image_base_useful(memory, memory_size))
+		image_capture_base(memory, memory_size);
+
+	image_write_base(filename);
+
+	FILE *fp = fopen(filename, "wb");
+
+	if (!fp)
+		wasm_error("Couldn't open save image for writing");
+
+	wasm_image_header_t header = {
+		.magic = IMAGE_MAGIC,
+		.version = IMAGE_VERSION,
+		.kind = IMAGE_DELTA,
+		.memory_size = memory_size,
+		.module_hash = image_save.module_hash,
+		.base_id = image_save.base_id,
+		.buffers_addr = wasm.buffers_addr,
+		.defer_queue = wasm.defer_queue
+	};
+
+	snprintf(header.level, sizeof(header.level), "%s", image_save.level_written);
+
+	fwrite(&header, sizeof(header), 1, fp);
+
+	image_write_runs(fp, memory, memory_size, image_save.base, image_save.base_size);
+
+	wasm_pool_write_image(fp);
+	q2_wasm_write_image_tables(fp);
+
+	if (ferror(fp))
+	{
+		fclose(fp);
+		wasm_error("Couldn't write save image");
+	}
+
+	fclose(fp);
+}
+
+// Reads a file into a TAG_GAME buffer if it's an image; returns NULL
+// for anything else, so it can be handed to the game's loader instead.
+static uint8_t *image_load(const char *filename, size_t *size)
+{
+	FILE *fp = fopen(filename, "rb");
+
+	if (!fp)
+		return NULL;
+
+	char magic[4];
+
+	if (fread(magic, 1, sizeof(magic), fp) != sizeof(magic) || memcmp(magic, IMAGE_MAGIC, sizeof(magic)))
+	{
+		fclose(fp);
+		return NULL;
+	}
+
+	fseek(fp, 0, SEEK_END);
+	*size = (size_t) ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	uint8_t *data = (uint8_t *) gi.TagMalloc((int32_t) *size, TAG_GAME);
+
+	if (fread(data, 1, *size, fp) != *size)
+	{
+		fclose(fp);
+		gi.TagFree(data);
+		wasm_error("Couldn't read save image");
+	}
+
+	fclose(fp);
+	return data;
+}
+
+// Reads the base a delta next to filename was made against. It becomes
+// the current base too, so saves made after loading stay small.
+static void image_load_base(const char *filename, uint64_t base_id)
+{
+	char path[MAX_INFO_STRING];
+	size_t size;
+
+	image_base_path(filename, path, sizeof(path));
+
+	uint8_t *data = image_load(path, &size);
+
+	if (!data)
+		wasm_error("Save image base " IMAGE_BASE_NAME " is missing");
+
+	wasm_image_reader_t r = { data, size, 0 };
+	wasm_image_header_t header;
+
+	if (!wasm_image_read(&r, &header, sizeof(header)) || header.version != IMAGE_VERSION ||
+		header.kind != IMAGE_BASE || header.base_id != base_id || header.module_hash != image_save.module_hash)
+	{
+		gi.TagFree(data);
+		wasm_error("Save image doesn't match its " IMAGE_BASE_NAME);
+	}
+
+	if (image_save.base_alloc < header.memory_size)
+	{
+		if (image_save.base)
+			gi.TagFree(image_save.base);
+
+		image_save.base = (uint8_t *) gi.TagMalloc((int32_t) header.memory_size, TAG_GAME);
+		image_save.base_alloc = header.memory_size;
+	}
+
+	memset(image_save.base, 0, header.memory_size);
+
+	if (!image_read_runs(&r, image_save.base, header.memory_size))
+	{
+		gi.TagFree(data);
+		wasm_error("Save image base is corrupt");
+	}
+
+	image_save.base_size = header.memory_size;
+	image_save.base_id = header.base_id;
+
+	gi.TagFree(data);
+}
+
+static void image_restore(const uint8_t *data, size_t size, const char *filename)
+{
+	wasm_image_reader_t r = { data, size, 0 };
+	wasm_image_header_t header;
+
+	if (!image_save.supported)
+		wasm_error("This save is a memory image, which needs sys_wasmheapsize 0 and a module that exports malloc and free");
+
+	if (!wasm_image_read(&r, &header, sizeof(header)) || header.version != IMAGE_VERSION ||
+		(header.kind != IMAGE_FULL && header.kind != IMAGE_DELTA))
+		wasm_error("Unsupported save image version");
+
+	if (header.module_hash != image_save.module_hash)
+		wasm_error("Save image was made with a different game module");
+
+	if (header.kind == IMAGE_DELTA)
+	{
+		image_load_base(filename, header.base_id);
+
+		// memory never shrinks, so the base can't be bigger
+		if (image_save.base_size > header.memory_size)
+			wasm_error("Save image is corrupt");
+	}
+
+	uint32_t memory_size;
+	uint8_t *memory = image_memory(&memory_size);
+
+	if (memory_size < header.memory_size)
+	{
+		wasm_memory_inst_t mem = wasm_runtime_get_default_memory(wasm.module_inst);
+		const uint64_t page_size = wasm_memory_get_bytes_per_page(mem);
+
+		if (!wasm_runtime_enlarge_memory(wasm.module_inst, (header.memory_size - memory_size + page_size - 1) / page_size))
+			wasm_error("Couldn't grow WASM memory to fit save image");
+
+		wasm_sync_memory();
+		memory = image_memory(&memory_size);
+	}
+
+	if (header.kind == IMAGE_DELTA)
+	{
+		memcpy(memory, image_save.base, image_save.base_size);
+		memset(memory + image_save.base_size, 0, memory_size - image_save.base_size);
+	}
+	else
+		memset(memory, 0, memory_size);
+
+	if (!image_read_runs(&r, memory, header.memory_size))
+		wasm_error("Save image is corrupt");
+
+	wasm.buffers_addr = header.buffers_addr;
+	wasm.defer_queue = header.defer_queue;
+
+	if (!wasm_pool_read_image(&r) || !q2_wasm_read_image_tables(&r))
+		wasm_error("Save image is corrupt");
+}
+
+static void image_drop_stash(void)
+{
+	if (image_save.stash)
+	{
+		gi.TagFree(image_save.stash);
+		image_save.stash = NULL;
+	}
+}
+
+bool q2_wasm_read_game_image(const char *filename)
+{
+	size_t size;
+	uint8_t *data = image_load(filename, &size);
+
+	image_drop_stash();
+
+	if (!data)
+		return false;
+
+	image_restore(data, size, filename);
+
+	const wasm_image_header_t *header = (const wasm_image_header_t *) data;
+
+	if (header->level[0])
+	{
+		image_save.stash = data;
+		image_save.stash_size = size;
+		image_save.stash_spawned = false;
+	}
+	else
+		gi.TagFree(data);
+
+	return true;
+}
+
+// filename is in the same directory as the game file
+// was, so a delta's base is found next to it as well
+bool q2_wasm_read_level_image(const char *filename)
+{
+	if (!image_save.stash)
+		return false;
+
+	const wasm_image_header_t *header = (const wasm_image_header_t *) image_save.stash;
+	const bool match = !strcmp(header->level, filename);
+
+	if (match)
+		image_restore(image_save.stash, image_save.stash_size, filename);
+
+	image_drop_stash();
+
+	return match;
+}
+
+void q2_wasm_image_level_written(const char *filename)
+{
+	snprintf(image_save.level_written, sizeof(image_save.level_written), "%s", filename);
+}
+
+// the world moved on, so the last level written no longer
+// matches what an image taken now would have
+void q2_wasm_image_level_changed(void)
+{
+	image_save.level_written[0] = 0;
+
+	// the first spawn after ReadGame is the one loading the saved
+	// level; any after that means its ReadLevel never came
+	if (image_save.stash_spawned)
+		image_drop_stash();
+	else
+		image_save.stash_spawned = true;
+}
+
+void q2_wasm_image_end_frame(void)
+{
+	image_save.level_written[0] = 0;
+}
+
+#ifdef _WIN32
+#define ram_lock()		AcquireSRWLockExclusive(&ram_saves.lock)
+#define ram_unlock()	ReleaseSRWLockExclusive(&ram_saves.lock)
+#define ram_wait(c)		SleepConditionVariableSRW(&ram_saves.c, &ram_saves.lock, INFINITE, 0)
+#define ram_signal(c)	WakeAllConditionVariable(&ram_saves.c)
+#else
+#define ram_lock()		pthread_mutex_lock(&ram_saves.lock)
+#define ram_unlock()	pthread_mutex_unlock(&ram_saves.lock)
+#define ram_wait(c)		pthread_cond_wait(&ram_saves.c, &ram_saves.lock)
+#define ram_signal(c)	pthread_cond_broadcast(&ram_saves.c)
+#endif
+
+static ram_save_t *ram_next_dirty(void)
+{
+	for (ram_save_t *save = ram_saves.saves; save; save = save->next)
+		if (save->dirty)
+			return save;
+
+	return NULL;
+}
+
+static bool ram_any_pending(void)
+{
+	for (ram_save_t *save = ram_saves.saves; save; save = save->next)
+		if (save->dirty || save->flushing)
+			return true;
+
+	return false;
+}
+
+// writes data to path's .tmp
+static bool ram_write_temp(const char *path, const uint8_t *data, size_t size)
+{
+	char temp_path[MAX_INFO_STRING + 4];
+	snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+
+	FILE *fp = fopen(temp_path, "wb");
+
+	if (!fp)
+		return false;
+
+	bool ok = fwrite(data, 1, size, fp) == size;
+	ok = fclose(fp) == 0 && ok;
+
+	if (!ok)
+		remove(temp_path);
+
+	return ok;
+}
+
+// The flush thread only ever reads an entry's data; the main thread
+// doesn't touch an entry again until it's been written out.
+#ifdef _WIN32
+static unsigned __stdcall ram_flush_thread(void *arg)
+#else
+static void *ram_flush_thread(void *arg)
+#endif
+{
+	(void) arg;
+
+	ram_lock();
+
+	for (;;)
+	{
+		ram_save_t *save;
+
+		while (!ram_saves.quit && !(save = ram_next_dirty()))
+			ram_wait(work);
+
+		if (!save)
+			break;
+
+		char mirror[MAX_INFO_STRING];
+		snprintf(mirror, sizeof(mirror), "%s", save->mirror);
+
+		save->dirty = false;
+		save->flushing = true;
+		ram_unlock();
+
+		const bool ok = ram_write_temp(save->path, save->data, save->size);
+		const bool mirror_ok = mirror[0] && ram_write_temp(mirror, save->data, save->size);
+
+		ram_lock();
+		save->flushing = false;
+		save->written = ok;
+		save->mirror_written = mirror_ok;
+		ram_signal(done);
+	}
+
+	ram_unlock();
+	return 0;
+}
+
+void q2_wasm_init_ram_saves(bool enabled)
+{
+	ram_saves.enabled = enabled;
+	ram_saves.quit = false;
+
+	if (!enabled)
+		return;
+
+#ifdef _WIN32
+	InitializeSRWLock(&ram_saves.lock);
+	InitializeConditionVariable(&ram_saves.work);
+	InitializeConditionVariable(&ram_saves.done);
+	ram_saves.thread = (HANDLE) _beginthreadex(NULL, 0, ram_flush_thread, NULL, 0, NULL);
+	ram_saves.started = ram_saves.thread != NULL;
+#else
+	pthread_mutex_init(&ram_saves.lock, NULL);
+	pthread_cond_init(&ram_saves.work, NULL);
+	pthread_cond_init(&ram_saves.done, NULL);
+	ram_saves.started = pthread_create(&ram_saves.thread, NULL, ram_flush_thread, NULL) == 0;
+#endif
+
+	if (!ram_saves.started)
+	{
+		gi.dprintf("Couldn't start autosave flush thread; autosaves will go straight to disk\n");
+		ram_saves.enabled = false;
+	}
+}
+
+void q2_wasm_ram_autosave(bool autosave)
+{
+	ram_saves.autosave = autosave;
+}
+
+static void ram_replace_file(const char *from, const char *to)
+{
+#ifdef _WIN32
+	MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING);
+#else
+	rename(from, to);
+#endif
+}
+
+static void ram_commit_temp(const char *path)
+{
+	char temp_path[MAX_INFO_STRING + 4];
+	snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+
+	ram_replace_file(temp_path, path);
+}
+
+// call with the lock held
+static void ram_commit_written(void)
+{
+	for (ram_save_t *save = ram_saves.saves; save; save = save->next)
+	{
+		if (save->written)
+		{
+			ram_commit_temp(save->path);
+			save->written = false;
+			save->placeholder = false;
+		}
+
+		if (save->mirror_written)
+		{
+			ram_commit_temp(save->mirror);
+			save->mirror_written = false;
+			save->mirror[0] = 0;
+		}
+	}
+}
+
+// blocks until everything in the store is on disk
+void q2_wasm_flush_ram_saves(void)
+{
+	if (!ram_saves.started)
+		return;
+
+	ram_lock();
+
+	while (ram_any_pending())
+		ram_wait(done);
+
+	ram_commit_written();
+	ram_unlock();
+}
+
+// After an autosave's WriteGame: filename is in the current save
+// directory, and everything the store has from there also has to
+// go to the autosave slot next to it.
+void q2_wasm_ram_mirror_autosave(const char *filename)
+{
+	if (!ram_saves.started)
+		return;
+
+	const char *slash = strrchr(filename, '/');
+
+	if (!slash)
+		return;
+
+	const int dir_length = (int) (slash - filename);
+	int parent_length = dir_length;
+
+	while (parent_length > 0 && filename[parent_length - 1] != '/')
+		parent_length--;
+
+	if (!parent_length--)
+		return;
+
+	ram_lock();
+
+	for (ram_save_t *save = ram_saves.saves; save; save = save->next)
+	{
+		if (strncmp(save->path, filename, dir_length + 1))
+			continue;
+
+		snprintf(save->mirror, sizeof(save->mirror), "%.*s/" RAM_AUTOSAVE_SLOT "/%s", parent_length, filename, save->path + dir_length + 1);
+		save->dirty = true;
+	}
+
+	ram_signal(work);
+	ram_unlock();
+}
+
+// puts whatever the flush thread has finished in place, without waiting
+void q2_wasm_commit_ram_saves(void)
+{
+	if (!ram_saves.started)
+		return;
+
+	ram_lock();
+	ram_commit_written();
+	ram_unlock();
+}
+
+static void ram_free_saves(void)
+{
+	while (ram_saves.saves)
+	{
+		ram_save_t *next = ram_saves.saves->next;
+
+		if (ram_saves.saves->data)
+			gi.TagFree(ram_saves.saves->data);
+		gi.TagFree(ram_saves.saves);
+		ram_saves.saves = next;
+	}
+}
+
+// Anything not renamed into place in the current directory yet is
+// dropped. The engine only copies files out of it right after WriteGame,
+// which waits for the store unless it's an autosave; and when loading a
+// save, the engine has already copied it over the directory before the
+// game is shut down, so putting what we have here in place would clobber
+// it. Copies still owed to the autosave slot are finished, though, since
+// the slot would be left with whatever the engine copied into it.
+void q2_wasm_shutdown_ram_saves(void)
+{
+	if (!ram_saves.started)
+		return;
+
+	ram_lock();
+
+	for (ram_save_t *save = ram_saves.saves; save; save = save->next)
+		if (!save->mirror[0])
+			save->dirty = false;
+
+	while (ram_any_pending())
+		ram_wait(done);
+
+	for (ram_save_t *save = ram_saves.saves; save; save = save->next)
+	{
+		if (save->mirror[0] && !save->mirror_written)
+			save->mirror_written = ram_write_temp(save->mirror, save->data, save->size);
+
+		if (save->mirror_written)
+			ram_commit_temp(save->mirror);
+	}
+
+	ram_saves.quit = true;
+	ram_signal(work);
+	ram_unlock();
+
+#ifdef _WIN32
+	WaitForSingleObject(ram_saves.thread, INFINITE);
+	CloseHandle(ram_saves.thread);
+#else
+	pthread_join(ram_saves.thread, NULL);
+	pthread_cond_destroy(&ram_saves.work);
+	pthread_cond_destroy(&ram_saves.done);
+	pthread_mutex_destroy(&ram_saves.lock);
+#endif
+
+	for (ram_save_t *save = ram_saves.saves; save; save = save->next)
+	{
+		if (save->written)
+		{
+			char temp_path[MAX_INFO_STRING + 4];
+			snprintf(temp_path, sizeof(temp_path), "%s.tmp", save->path);
+			remove(temp_path);
+		}
+
+		// don't leave a level behind that can't be read; a real
+		// save the engine copied here is never empty
+		if (save->placeholder)
+		{
+			FILE *fp = fopen(save->path, "rb");
+			bool empty = false;
+
+			if (fp)
+			{
+				empty = fgetc(fp) == EOF;
+				fclose(fp);
+			}
+
+			if (empty)
+				remove(save->path);
+		}
+	}
+
+	ram_free_saves();
+
+	ram_saves.started = false;
+	ram_saves.enabled = false;
+}
+
+static ram_save_t *ram_find(const char *path)
+{
+	for (ram_save_t *save = ram_saves.saves; save; save = save->next)
+		if (!strcmp(save->path, path))
+			return save;
+
+	return NULL;
+}
+
+// An empty placeholder can outlive the process that made it, if it died
+// before the level was written out; a level like that is treated as one
+// that was never saved, rather than handed to the game to fail on.
+bool q2_wasm_save_missing(const char *path)
+{
+	if (ram_saves.enabled && ram_find(path))
+		return false;
+
+	FILE *fp = fopen(path, "rb");
+
+	if (!fp)
+		return true;
+
+	const bool empty = fgetc(fp) == EOF;
+	fclose(fp);
+
+	return empty;
+}
+
+// Returns NULL if this file isn't handled by the store, and the
+// caller should go to disk instead.
+wasm_ram_file_t *q2_wasm_ram_open(const char *path, bool write)
+{
+	if (!ram_saves.enabled)
+		return NULL;
+
+	ram_save_t *save = ram_find(path);
+
+	if (!write)
+	{
+		if (!save || save->open)
+			return NULL;
+	}
+	else
+	{
+		if (!ram_saves.autosave)
+		{
+			// a regular save of something we have; the file on disk
+			// is about to be replaced, so the copy here has to go
+			if (save)
+			{
+				q2_wasm_flush_ram_saves();
+
+				if (save->data)
+					gi.TagFree(save->data);
+
+				save->data = NULL;
+				save->size = save->alloc = 0;
+				save->path[0] = 0;
+				save->placeholder = false;
+			}
+
+			return NULL;
+		}
+
+		// the engine only checks that the file exists, so an older
+		// copy of it stays on disk until the new one replaces it
+		FILE *fp = fopen(path, "rb");
+		bool placeholder = false;
+
+		if (!fp)
+		{
+			if (!(fp = fopen(path, "wb")))
+				return NULL;
+
+			placeholder = true;
+		}
+
+		fclose(fp);
+
+		if (save)
+		{
+			// make sure the last copy of it isn't being written out
+			q2_wasm_flush_ram_saves();
+			save->size = 0;
+		}
+		else
+		{
+			save = (ram_save_t *) gi.TagMalloc(sizeof(ram_save_t), TAG_GAME);
+			snprintf(save->path, sizeof(save->path), "%s", path);
+			save->next = ram_saves.saves;
+			ram_saves.saves = save;
+		}
+
+		save->placeholder = save->placeholder || placeholder;
+
+		save->open = true;
+	}
+
+	wasm_ram_file_t *file = (wasm_ram_file_t *) gi.TagMalloc(sizeof(wasm_ram_file_t), TAG_GAME);
+
+	file->save = save;
+	file->pos = 0;
+	file->write = write;
+
+	return file;
+}
+
+uint32_t q2_wasm_ram_write(wasm_ram_file_t *file, const void *data, uint32_t size)
+{
+	ram_save_t *save = file->save;
+
+	if (!file->write)
+		return 0;
+
+	if (save->size + size > save->alloc)
+	{
+		size_t alloc = save->alloc ? save->alloc : 65536;
+
+		while (alloc < save->size + size)
+			alloc *= 2;
+
+		uint8_t *grown = (uint8_t *) gi.TagMalloc((int32_t) alloc, TAG_GAME);
+
+		if (save->data)
+		{
+			memcpy(grown, save->data, save->size);
+			gi.TagFree(save->data);
+		}
+
+		save->data = grown;
+		save->alloc = alloc;
+	}
+
+	memcpy(save->data + save->size, data, size);
+	save->size += size;
+
+	return size;
+}
+
+uint32_t q2_wasm_ram_read(wasm_ram_file_t *file, void *data, uint32_t size)
+{
+	const ram_save_t *save = file->save;
+
+	if (file->write)
+		return 0;
+
+	if (size > save->size - file->pos)
+		size = (uint32_t) (save->size - file->pos);
+
+	memcpy(data, save->data + file->pos, size);
+	file->pos += size;
+
+	return size;
+}
+
+void q2_wasm_ram_close(wasm_ram_file_t *file)
+{
+	ram_save_t *save = file->save;
+
+	if (file->write)
+	{
+		save->open = false;
+
+		ram_lock();
+		save->dirty = true;
+		ram_signal(work);
+		ram_unlock();
+	}
+
+	gi.TagFree(file);
+}
+
+// Level deltas. Most of a level file is what SpawnEntities already built
+// from the entity string, so right after a level spawns, the game's
+// WriteLevel is run once into a temporary file to get the level as it
+// was spawned. Level files written after that only keep what differs
+// from that baseline: runs copied from it, and the bytes in between.
+// ReadLevel puts the whole file back together before the game reads it,
+// so the game's own format is never touched.
+//
+// The game's output shifts around as entities come and go, so matches
+// are found at any offset, rsync-style: the baseline is indexed in
+// fixed blocks, and a rolling hash over the new file looks them up.
+//
+// The baseline is written out as <level>.spawn.sav next to the level,
+// which matches the engine's *.sav pattern so it's copied along with the
+// save. It's only rewritten when it changed; since the engine keeps one
+// file per level, the only delta made against the old one is the file
+// that's being replaced. Levels written in the background or kept in the
+// autosave store stay whole.
+#define LEVEL_DELTA_MAGIC	"WLVD"
+#define LEVEL_BASE_MAGIC	"WLVB"
+#define LEVEL_DELTA_VERSION	1
+#define LEVEL_BLOCK			64
+#define LEVEL_HASH_MUL		16777619u
+
+typedef struct
+{
+	char		magic[4];
+	uint32_t	version;
+	uint32_t	size;		// of the whole file; for a baseline, what follows
+	uint32_t	base_size;
+	uint64_t	base_hash;
+} level_delta_header_t;
+
+typedef struct
+{
+	uint32_t	hash;
+	uint32_t	offset;		// + 1; 0 is an empty slot
+} level_block_t;
+
+static struct
+{
+	bool		enabled;
+
+	// the current level as it was spawned
+	uint8_t		*base;
+	uint32_t	base_size;
+	uint64_t	base_hash;
+} level_delta;
+
+void q2_wasm_init_level_deltas(bool enabled)
+{
+	level_delta.enabled = enabled;
+	level_delta.base = NULL;
+	level_delta.base_size = 0;
+}
+
+bool q2_wasm_level_deltas_enabled(void)
+{
+	return level_delta.enabled;
+}
+
+static uint64_t level_hash(const uint8_t *data, uint32_t size)
+{
+	uint64_t hash = 14695981039346656037ull;
+
+	for (uint32_t i = 0; i < size; i++)
+		hash = (hash ^ data[i]) * 1099511628211ull;
+
+	return hash;
+}
+
+// Reads a whole file into a TAG_GAME buffer; NULL if it can't be read.
+static uint8_t *level_load_file(const char *path, uint32_t *size)
+{
+	FILE *fp = fopen(path, "rb");
+
+	if (!fp)
+		return NULL;
+
+	fseek(fp, 0, SEEK_END);
+	const long length = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	if (length <= 0 || (uint64_t) length > INT32_MAX)
+	{
+		fclose(fp);
+		return NULL;
+	}
+
+	uint8_t *data = (uint8_t *) gi.TagMalloc((int32_t) length, TAG_GAME);
+
+	if (fread(data, 1, (size_t) length, fp) != (size_t) length)
+	{
+		fclose(fp);
+		gi.TagFree(data);
+		return NULL;
+	}
+
+	fclose(fp);
+
+	*size = (uint32_t) length;
+	return data;
+}
+
+// path is where the game just wrote the level as it was spawned
+void q2_wasm_capture_level_base(const char *path)
+{
+	if (level_delta.base)
+	{
+		gi.TagFree(level_delta.base);
+		level_delta.base = NULL;
+	}
+
+	level_delta.base = level_load_file(path, &level_delta.base_size);
+	remove(path);
+
+	if (level_delta.base)
+		level_delta.base_hash = level_hash(level_delta.base, level_delta.base_size);
+}
+
+static void level_base_path(const char *filename, char *path, size_t path_size)
+{
+	const size_t length = strlen(filename);
+	const int stem = (length > 4 && !strcmp(filename + length - 4, ".sav")) ? (int) (length - 4) : (int) length;
+
+	snprintf(path, path_size, "%.*s.spawn.sav", stem, filename);
+}
+
+static bool level_read_header(FILE *fp, level_delta_header_t *header, const char *magic)
+{
+	return fread(header, sizeof(*header), 1, fp) == 1 &&
+		!memcmp(header->magic, magic, sizeof(header->magic)) &&
+		header->version == LEVEL_DELTA_VERSION;
+}
+
+// writes the baseline next to filename, unless it's already there
+static bool level_write_base(const char *filename)
+{
+	char path[MAX_INFO_STRING], temp_path[MAX_INFO_STRING + 4];
+	level_delta_header_t header;
+
+	level_base_path(filename, path, sizeof(path));
+
+	FILE *fp = fopen(path, "rb");
+
+	if (fp)
+	{
+		const bool current = level_read_header(fp, &header, LEVEL_BASE_MAGIC) &&
+			header.base_hash == level_delta.base_hash && header.size == level_delta.base_size;
+
+		fclose(fp);
+
+		if (current)
+			return true;
+	}
+
+	snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+
+	if (!(fp = fopen(temp_path, "wb")))
+		return false;
+
+	header = (level_delta_header_t) {
+		.magic = LEVEL_BASE_MAGIC,
+		.version = LEVEL_DELTA_VERSION,
+		.size = level_delta.base_size,
+		.base_size = level_delta.base_size,
+		.base_hash = level_delta.base_hash
+	};
+
+	fwrite(&header, sizeof(header), 1, fp);
+	fwrite(level_delta.base, 1, level_delta.base_size, fp);
+
+	const bool failed = ferror(fp);
+	fclose(fp);
+
+	if (failed)
+	{
+		remove(temp_path);
+		return false;
+	}
+
+	ram_replace_file(temp_path, path);
+	return true;
+}
+
+static uint32_t level_block_hash(const uint8_t *data)
+{
+	uint32_t hash = 0;
+
+	for (uint32_t i = 0; i < LEVEL_BLOCK; i++)
+		hash = hash * LEVEL_HASH_MUL + data[i];
+
+	return hash;
+}
+
+// one slot per baseline block at most half full; identical
+// blocks are only indexed once, so runs of zeroes don't pile up
+static level_block_t *level_index_base(uint32_t *mask)
+{
+	const uint32_t num_blocks = level_delta.base_size / LEVEL_BLOCK;
+	uint32_t num_slots = 16;
+
+	while (num_slots < num_blocks * 2)
+		num_slots *= 2;
+
+	level_block_t *table = (level_block_t *) gi.TagMalloc((int32_t) (num_slots * sizeof(level_block_t)), TAG_GAME);
+	memset(table, 0, num_slots * sizeof(level_block_t));
+
+	*mask = num_slots - 1;
+
+	for (uint32_t offset = 0; offset + LEVEL_BLOCK <= level_delta.base_size; offset += LEVEL_BLOCK)
+	{
+		const uint8_t *block = level_delta.base + offset;
+		const uint32_t hash = level_block_hash(block);
+		uint32_t slot = hash & *mask;
+
+		for (; table[slot].offset; slot = (slot + 1) & *mask)
+			if (table[slot].hash == hash && !memcmp(level_delta.base + table[slot].offset - 1, block, LEVEL_BLOCK))
+				break;
+
+		if (!table[slot].offset)
+			table[slot] = (level_block_t) { hash, offset + 1 };
+	}
+
+	return table;
+}
+
+static const level_block_t *level_find_block(const level_block_t *table, uint32_t mask, uint32_t hash, const uint8_t *data)
+{
+	for (uint32_t slot = hash & mask; table[slot].offset; slot = (slot + 1) & mask)
+		if (table[slot].hash == hash && !memcmp(level_delta.base + table[slot].offset - 1, data, LEVEL_BLOCK))
+			return &table[slot];
+
+	return NULL;
+}
+
+// each op is literal length, copy offset and copy length, followed
+// by the literal bytes; a 0 literal and 0 copy ends it
+static void level_write_op(FILE *fp, const uint8_t *literal, uint32_t literal_size, uint32_t copy_offset, uint32_t copy_size)
+{
+	const uint32_t op[3] = { literal_size, copy_offset, copy_size };
+
+	fwrite(op, sizeof(op), 1, fp);
+
+	if (literal_size)
+		fwrite(literal, 1, literal_size, fp);
+}
+
+static void level_write_ops(FILE *fp, const uint8_t *data, uint32_t size)
+{
+	uint32_t mask;
+	level_block_t *table = level_index_base(&mask);
+
+	// LEVEL_HASH_MUL ^ (LEVEL_BLOCK - 1), to roll the oldest byte out
+	uint32_t out_mul = 1;
+
+	for (uint32_t i = 1; i < LEVEL_BLOCK; i++)
+		out_mul *= LEVEL_HASH_MUL;
+
+	uint32_t pos = 0, literal_start = 0;
+	uint32_t hash = size >= LEVEL_BLOCK ? level_block_hash(data) : 0;
+
+	while (pos + LEVEL_BLOCK <= size)
+	{
+		const level_block_t *block = level_find_block(table, mask, hash, data + pos);
+
+		if (!block)
+		{
+			if (pos + LEVEL_BLOCK < size)
+				hash = (hash - data[pos] * out_mul) * LEVEL_HASH_MUL + data[pos + LEVEL_BLOCK];
+
+			pos++;
+			continue;
+		}
+
+		uint32_t from = block->offset - 1, length = LEVEL_BLOCK;
+
+		while (pos + length < size && from + length < level_delta.base_size && data[pos + length] == level_delta.base[from + length])
+			length++;
+
+		// the match may have started inside the pending literal
+		while (pos > literal_start && from && data[pos - 1] == level_delta.base[from - 1])
+		{
+			pos--;
+			from--;
+			length++;
+		}
+
+		level_write_op(fp, data + literal_start, pos - literal_start, from, length);
+
+		pos += length;
+		literal_start = pos;
+
+		if (pos + LEVEL_BLOCK <= size)
+			hash = level_block_hash(data + pos);
+	}
+
+	if (literal_start < size)
+		level_write_op(fp, data + literal_start, size - literal_start, 0, 0);
+
+	level_write_op(fp, NULL, 0, 0, 0);
+
+	gi.TagFree(table);
+}
+
+// Replaces the level the game just wrote to filename with a delta
+// against the spawn baseline, if there is one and it comes out smaller.
+// async is whether the game's WriteLevel was started in the background.
+void q2_wasm_write_level_delta(const char *filename, bool async)
+{
+	if (!level_delta.enabled || !level_delta.base || async || (ram_saves.enabled && ram_find(filename)))
+		return;
+
+	uint32_t size;
+	uint8_t *data = level_load_file(filename, &size);
+
+	if (!data)
+		return;
+
+	char temp_path[MAX_INFO_STRING + 6];
+	snprintf(temp_path, sizeof(temp_path), "%s.delta", filename);
+
+	FILE *fp;
+
+	if (!level_write_base(filename) || !(fp = fopen(temp_path, "wb")))
+	{
+		gi.TagFree(data);
+		return;
+	}
+
+	const level_delta_header_t header = {
+		.magic = LEVEL_DELTA_MAGIC,
+		.version = LEVEL_DELTA_VERSION,
+		.size = size,
+		.base_size = level_delta.base_size,
+		.base_hash = level_delta.base_hash
+	};
+
+	fwrite(&header, sizeof(header), 1, fp);
+	level_write_ops(fp, data, size);
+
+	const bool smaller = !ferror(fp) && ftell(fp) < (long) size;
+	fclose(fp);
+
+	gi.TagFree(data);
+
+	if (smaller)
+		ram_replace_file(temp_path, filename);
+	else
+		remove(temp_path);
+}
+
+static bool level_apply_ops(const uint8_t *ops, uint32_t ops_size, const uint8_t *base, uint32_t base_size, uint8_t *out, uint32_t out_size)
+{
+	wasm_image_reader_t r = { ops, ops_size, 0 };
+	uint32_t pos = 0;
+
+	for (;;)
+	{
+		uint32_t op[3];
+
+		if (!wasm_image_read(&r, op, sizeof(op)))
+			return false;
+
+		if (!op[0] && !op[2])
+			return pos == out_size;
+
+		if (op[0] > out_size - pos || !wasm_image_read(&r, out + pos, op[0]))
+			return false;
+
+		pos += op[0];
+
+		if (op[1] > base_size || op[2] > base_size - op[1] || op[2] > out_size - pos)
+			return false;
+
+		memcpy(out + pos, base + op[1], op[2]);
+		pos += op[2];
+	}
+}
+
+// If filename is a level delta, puts the whole level back together at
+// out_path for the game to read, and returns true. Anything else is
+// left for the game to read as it is.
+bool q2_wasm_expand_level_delta(const char *filename, const char *out_path)
+{
+	if (ram_saves.enabled && ram_find(filename))
+		return false;
+
+	FILE *fp = fopen(filename, "rb");
+	level_delta_header_t header;
+
+	if (!fp)
+		return false;
+
+	const bool delta = level_read_header(fp, &header, LEVEL_DELTA_MAGIC);
+	fclose(fp);
+
+	if (!delta)
+		return false;
+
+	char path[MAX_INFO_STRING];
+	uint32_t size, base_size;
+
+	level_base_path(filename, path, sizeof(path));
+
+	uint8_t *data = level_load_file(filename, &size);
+	uint8_t *base = level_load_file(path, &base_size);
+
+	if (!base)
+		wasm_error("Level file's spawn baseline is missing");
+
+	const level_delta_header_t *base_header = (const level_delta_header_t *) base;
+
+	if (!data || base_size < sizeof(*base_header) || memcmp(base_header->magic, LEVEL_BASE_MAGIC, sizeof(base_header->magic)) ||
+		base_header->version != LEVEL_DELTA_VERSION || base_header->size != header.base_size ||
+		base_size - sizeof(*base_header) != header.base_size ||
+		level_hash(base + sizeof(*base_header), header.base_size) != header.base_hash)
+		wasm_error("Level file doesn't match its spawn baseline");
+
+	uint8_t *level = (uint8_t *) gi.TagMalloc((int32_t) header.size, TAG_GAME);
+
+	if (!level_apply_ops(data + sizeof(header), size - (uint32_t) sizeof(header), base + sizeof(*base_header), header.base_size, level, header.size))
+		wasm_error("Level file is corrupt");
+
+	gi.TagFree(data);
+	gi.TagFree(base);
+
+	if (!(fp = fopen(out_path, "wb")))
+		wasm_error("Couldn't write out level file");
+
+	fwrite(level, 1, header.size, fp);
+
+	if (ferror(fp))
+	{
+		fclose(fp);
+		wasm_error("Couldn't write out level file");
+	}
+
+	fclose(fp);
+	gi.TagFree(level);
+
+	return true;
+}
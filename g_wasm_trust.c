@@ -0,0 +1,168 @@
+/*
+Copyright (C) 1997-2001 Id Software, Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+#include <stdio.h>
+#include <ctype.h>
+
+#include "g_main.h"
+#include "g_wasm.h"
+
+// Trusted modules skip some of the bridge's pointer checks, so they are
+// picked by a SHA-256 of the module's file as it was read from disk, before
+// WAMR got to patch anything. Anything weaker would let a module be made to
+// collide with one on the list. A module from the AoT cache goes by the
+// game.wasm it was compiled from; a hand-built .aot goes by its own file.
+
+typedef struct
+{
+	uint32_t	state[8];
+	uint64_t	length;
+} sha256_t;
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR(x, n) \
+	(((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(sha256_t *ctx, const uint8_t *p)
+{
+	uint32_t w[64], s[8];
+
+	for (int32_t i = 0; i < 16; i++)
+		w[i] = ((uint32_t) p[i * 4] << 24) | ((uint32_t) p[i * 4 + 1] << 16) | ((uint32_t) p[i * 4 + 2] << 8) | p[i * 4 + 3];
+
+	for (int32_t i = 16; i < 64; i++)
+	{
+		const uint32_t s0 = ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		const uint32_t s1 = ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	memcpy(s, ctx->state, sizeof(s));
+
+	for (int32_t i = 0; i < 64; i++)
+	{
+		const uint32_t t1 = s[7] + (ROR(s[4], 6) ^ ROR(s[4], 11) ^ ROR(s[4], 25)) + ((s[4] & s[5]) ^ (~s[4] & s[6])) + sha256_k[i] + w[i];
+		const uint32_t t2 = (ROR(s[0], 2) ^ ROR(s[0], 13) ^ ROR(s[0], 22)) + ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+
+		memmove(s + 1, s, sizeof(uint32_t) * 7);
+		s[4] += t1;
+		s[0] = t1 + t2;
+	}
+
+	for (int32_t i = 0; i < 8; i++)
+		ctx->state[i] += s[i];
+}
+
+static void sha256(const uint8_t *data, size_t size, uint8_t digest[32])
+{
+	sha256_t ctx = {
+		{ 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 },
+		(uint64_t) size * 8
+	};
+
+	for (; size >= 64; data += 64, size -= 64)
+		sha256_block(&ctx, data);
+
+	// the tail, the 1 bit, and the length in bits take one or two blocks
+	uint8_t tail[128] = { 0 };
+	const size_t tail_size = size < 56 ? 64 : 128;
+
+	memcpy(tail, data, size);
+	tail[size] = 0x80;
+
+	for (int32_t i = 0; i < 8; i++)
+		tail[tail_size - 1 - i] = (uint8_t) (ctx.length >> (i * 8));
+
+	for (size_t i = 0; i < tail_size; i += 64)
+		sha256_block(&ctx, tail + i);
+
+	for (int32_t i = 0; i < 32; i++)
+		digest[i] = (uint8_t) (ctx.state[i / 4] >> (24 - (i % 4) * 8));
+}
+
+void q2_wasm_module_digest(const uint8_t *data, uint32_t size, uint8_t digest[32])
+{
+	sha256(data, size, digest);
+}
+
+/*
+============
+q2_wasm_module_trusted
+
+Checks a module digest against wasm_trusted.txt in the game directory,
+which lists one SHA-256 in hex per line; anything after a # is ignored.
+============
+*/
+bool q2_wasm_module_trusted(const char *base_directory, const uint8_t digest[32])
+{
+	char hex[65];
+
+	for (int32_t i = 0; i < 32; i++)
+		snprintf(hex + i * 2, 3, "%02x", digest[i]);
+
+	char path[MAX_INFO_STRING];
+	snprintf(path, sizeof(path), "%s/wasm_trusted.txt", base_directory);
+
+	FILE *fp = fopen(path, "r");
+	bool trusted = false;
+
+	if (fp)
+	{
+		char line[256];
+
+		while (!trusted && fgets(line, sizeof(line), fp))
+		{
+			char *p = line;
+
+			while (isspace((unsigned char) *p))
+				p++;
+
+			size_t len = 0;
+
+			while (isxdigit((unsigned char) p[len]))
+				len++;
+
+			if (len != 64)
+				continue;
+
+			trusted = true;
+
+			for (size_t i = 0; i < len && trusted; i++)
+				trusted = tolower((unsigned char) p[i]) == hex[i];
+		}
+
+		fclose(fp);
+	}
+
+	if (!trusted)
+		gi.dprintf("Game module %s isn't in wasm_trusted.txt, keeping all of the bridge's checks\n", hex);
+
+	return trusted;
+}
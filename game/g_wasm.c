@@ -26,9 +26,15 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 
 #ifdef __wasm__
 
+// for fopencookie
+#define _GNU_SOURCE
+
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "g_api.h"
+#include "g_wasm_ext.h"
 
 #define WASM_EXPORT(name) \
 	__attribute__((export_name(#name)))
@@ -52,6 +58,7 @@ DECLARE_IMPORT(void, error, const char *);
 DECLARE_IMPORT(int32_t, modelindex, const char *);
 DECLARE_IMPORT(int32_t, soundindex, const char *);
 DECLARE_IMPORT(int32_t, imageindex, const char *);
+DECLARE_IMPORT(void, precache_batch, wasm_precache_t *, uint32_t);
 
 DECLARE_IMPORT(void, setmodel, edict_t *, const char *);
 
@@ -71,6 +78,7 @@ DECLARE_IMPORT(void, Pmove, pmove_t *pmove);
 
 DECLARE_IMPORT(void, multicast, vec_t, vec_t, vec_t, multicast_t);
 DECLARE_IMPORT(void, unicast, edict_t *, qboolean);
+DECLARE_IMPORT(void, unicast_mask, const uint8_t *, uint32_t, const uint32_t *, const uint32_t *);
 
 DECLARE_IMPORT(void, WriteChar, int32_t);
 DECLARE_IMPORT(void, WriteByte, int32_t);
@@ -81,6 +89,7 @@ DECLARE_IMPORT(void, WriteString, const char *);
 DECLARE_IMPORT(void, WritePosition, vec_t, vec_t, vec_t);
 DECLARE_IMPORT(void, WriteDir, vec_t, vec_t, vec_t);
 DECLARE_IMPORT(void, WriteAngle, vec_t);
+DECLARE_IMPORT(void, WriteMessage, const uint8_t *, uint32_t);
 
 DECLARE_IMPORT(void *, TagMalloc, uint32_t, uint32_t);
 DECLARE_IMPORT(void, TagFree, void *);
@@ -98,6 +107,72 @@ DECLARE_IMPORT(void, AddCommandString, const char *);
 
 DECLARE_IMPORT(void, DebugGraph, vec_t, int32_t);
 
+DECLARE_IMPORT(wasm_defer_queue_t *, GetDeferQueue, void);
+DECLARE_IMPORT(void, FlushDeferQueue, void);
+
+DECLARE_IMPORT(int32_t, save_open, const char *, int32_t);
+DECLARE_IMPORT(uint32_t, save_write, int32_t, const void *, uint32_t);
+DECLARE_IMPORT(uint32_t, save_read, int32_t, void *, uint32_t);
+DECLARE_IMPORT(int32_t, save_close, int32_t);
+
+/*	Imports that don't return anything can be queued up and sent over
+	in bulk, if the bridge gave us a queue to do so. */
+static wasm_defer_queue_t *defer_queue;
+
+static uint8_t *wasm_defer_reserve(uint8_t op, uint32_t size)
+{
+	if (!defer_queue || size + 1 > defer_queue->size)
+		return NULL;
+
+	if (defer_queue->length + size + 1 > defer_queue->size)
+		wasm_FlushDeferQueue();
+
+	uint8_t *p = defer_queue->data + defer_queue->length;
+	*p = op;
+	defer_queue->length += size + 1;
+	defer_queue->count++;
+	return p + 1;
+}
+
+static qboolean wasm_defer_sound(uint8_t op, const vec3_t *origin, edict_t *ent, sound_channel_t channel, int32_t soundindex, vec_t volume, sound_attn_t attenuation, vec_t timeofs)
+{
+	uint8_t *p = wasm_defer_reserve(op, sizeof(wasm_defer_sound_t));
+
+	if (!p)
+		return qfalse;
+
+	const wasm_defer_sound_t snd = {
+		.ent = (uint32_t) ent,
+		.channel = channel,
+		.soundindex = soundindex,
+		.volume = volume,
+		.attenuation = attenuation,
+		.timeofs = timeofs,
+		.origin = origin ? *origin : (vec3_t) { 0, 0, 0 }
+	};
+
+	memcpy(p, &snd, sizeof(snd));
+	return qtrue;
+}
+
+static qboolean wasm_defer_print(uint8_t op, edict_t *ent, print_level_t level, const char *str)
+{
+	const uint32_t len = strlen(str) + 1;
+	uint8_t *p = wasm_defer_reserve(op, sizeof(wasm_defer_print_t) + len);
+
+	if (!p)
+		return qfalse;
+
+	const wasm_defer_print_t print = {
+		.ent = (uint32_t) ent,
+		.level = level
+	};
+
+	memcpy(p, &print, sizeof(print));
+	memcpy(p + sizeof(print), str, len);
+	return qtrue;
+}
+
 static char	string[1024];
 
 #define PARSE_VAR_ARGS \
@@ -109,7 +184,8 @@ static char	string[1024];
 static void wasm_wrap_bprintf(print_level_t printlevel, const char *format, ...)
 {
 	PARSE_VAR_ARGS;
-	wasm_bprint(printlevel, string);
+	if (!wasm_defer_print(DEFER_OP_BPRINT, NULL, printlevel, string))
+		wasm_bprint(printlevel, string);
 }
 
 static void wasm_wrap_dprintf(const char *format, ...)
@@ -121,13 +197,15 @@ static void wasm_wrap_dprintf(const char *format, ...)
 static void wasm_wrap_cprintf(edict_t *ent, print_level_t printlevel, const char *format, ...)
 {
 	PARSE_VAR_ARGS;
-	wasm_cprint(ent, printlevel, string);
+	if (!wasm_defer_print(DEFER_OP_CPRINT, ent, printlevel, string))
+		wasm_cprint(ent, printlevel, string);
 }
 
 static void wasm_wrap_centerprintf(edict_t *ent, const char *format, ...)
 {
 	PARSE_VAR_ARGS;
-	wasm_centerprint(ent, string);
+	if (!wasm_defer_print(DEFER_OP_CENTERPRINT, ent, 0, string))
+		wasm_centerprint(ent, string);
 }
 
 static void wasm_wrap_error(const char *format, ...)
@@ -157,21 +235,110 @@ static content_flags_t wasm_wrap_pointcontents(const vec3_t *point)
 	return wasm_pointcontents(point->x, point->y, point->z);
 }
 
+/*	Message writes are encoded here and sent over in one go right
+	before they're needed by multicast/unicast, instead of crossing
+	over for every single byte. */
+static uint8_t	msg_buffer[MAX_WASM_MSGLEN];
+static uint32_t	msg_length;
+static qboolean	msg_overflowed; // part of the current message was already sent over
+
+static void wasm_msg_flush(void)
+{
+	msg_overflowed = qfalse;
+
+	if (!msg_length)
+		return;
+
+	wasm_WriteMessage(msg_buffer, msg_length);
+	msg_length = 0;
+}
+
+static uint8_t *wasm_msg_reserve(uint8_t op, uint32_t size)
+{
+	if (msg_length + size + 1 > sizeof(msg_buffer))
+	{
+		wasm_msg_flush();
+		msg_overflowed = qtrue;
+	}
+
+	uint8_t *p = msg_buffer + msg_length;
+	*p = op;
+	msg_length += size + 1;
+	return p + 1;
+}
+
+#define WASM_MSG_WRITE(op, type, v) \
+	{ \
+		const type _v = (type) (v); \
+		memcpy(wasm_msg_reserve(op, sizeof(_v)), &_v, sizeof(_v)); \
+	}
+
+static void wasm_wrap_WriteChar(int32_t c)
+{
+	WASM_MSG_WRITE(MSG_OP_CHAR, int8_t, c);
+}
+
+static void wasm_wrap_WriteByte(int32_t c)
+{
+	WASM_MSG_WRITE(MSG_OP_BYTE, uint8_t, c);
+}
+
+static void wasm_wrap_WriteShort(int32_t c)
+{
+	WASM_MSG_WRITE(MSG_OP_SHORT, int16_t, c);
+}
+
+static void wasm_wrap_WriteLong(int32_t c)
+{
+	WASM_MSG_WRITE(MSG_OP_LONG, int32_t, c);
+}
+
+static void wasm_wrap_WriteFloat(vec_t f)
+{
+	WASM_MSG_WRITE(MSG_OP_FLOAT, vec_t, f);
+}
+
+static void wasm_wrap_WriteAngle(vec_t f)
+{
+	WASM_MSG_WRITE(MSG_OP_ANGLE, vec_t, f);
+}
+
+static void wasm_wrap_WriteString(const char *s)
+{
+	const uint32_t size = strlen(s) + 1;
+
+	// won't ever fit, so just send it as-is
+	if (size + 1 > sizeof(msg_buffer))
+	{
+		wasm_msg_flush();
+		wasm_WriteString(s);
+		return;
+	}
+
+	memcpy(wasm_msg_reserve(MSG_OP_STRING, size), s, size);
+}
+
 static void wasm_wrap_WriteDir(const vec3_t *point)
 {
-	return wasm_WriteDir(point->x, point->y, point->z);
+	WASM_MSG_WRITE(MSG_OP_DIR, vec3_t, *point);
 }
 
 static void wasm_wrap_WritePosition(const vec3_t *point)
 {
-	return wasm_WritePosition(point->x, point->y, point->z);
+	WASM_MSG_WRITE(MSG_OP_POSITION, vec3_t, *point);
+}
+
+static void wasm_wrap_sound(edict_t *ent, sound_channel_t channel, int soundindex, vec_t volume, sound_attn_t attenuation, vec_t timeofs)
+{
+	if (!wasm_defer_sound(DEFER_OP_SOUND, NULL, ent, channel, soundindex, volume, attenuation, timeofs))
+		wasm_sound(ent, channel, soundindex, volume, attenuation, timeofs);
 }
 
 static void wasm_wrap_positioned_sound(const vec3_t *origin, edict_t *ent, sound_channel_t channel, int soundindex, vec_t volume, sound_attn_t attenuation, vec_t timeofs)
 {
 	if (!origin)
-		wasm_sound(ent, channel, soundindex, volume, attenuation, timeofs);
-	else
+		wasm_wrap_sound(ent, channel, soundindex, volume, attenuation, timeofs);
+	else if (!wasm_defer_sound(DEFER_OP_POSITIONED_SOUND, origin, ent, channel, soundindex, volume, attenuation, timeofs))
 		wasm_positioned_sound(origin->x, origin->y, origin->z, ent, channel, soundindex, volume, attenuation, timeofs);
 }
 
@@ -192,9 +359,208 @@ static int32_t wasm_wrap_BoxEdicts(const vec3_t *mins, const vec3_t *maxs, edict
 
 static void wasm_wrap_multicast(const vec3_t *p, multicast_t to)
 {
+	wasm_msg_flush();
 	wasm_multicast(p->x, p->y, p->z, to);
 }
 
+static void wasm_wrap_unicast(edict_t *ent, qboolean reliable)
+{
+	wasm_msg_flush();
+	wasm_unicast(ent, reliable);
+}
+
+void wasm_ext_unicast_mask(const client_mask_t clients, const client_mask_t reliable)
+{
+	// the start of the message is already sitting in the engine's
+	// buffer, so it can't be replayed per-client anymore
+	if (msg_overflowed)
+		wasm_wrap_error("wasm_ext_unicast_mask: message too large");
+
+	wasm_unicast_mask(msg_buffer, msg_length, clients, reliable);
+	msg_length = 0;
+}
+
+/*	Name -> index results are remembered for the rest of the level, so
+	spawn functions that precache the same things for every instance of
+	an entity only cross over once per name. */
+#define PRECACHE_HASH_SIZE	512
+
+// vanilla layout; the bridge remaps these for other engines
+enum
+{
+	WASM_CS_MODELS = 32,
+	WASM_CS_LIGHTS = WASM_CS_MODELS + (256 * 3)
+};
+
+typedef struct precache_memo_s
+{
+	struct precache_memo_s	*next;
+	int32_t					index;
+	char					name[];
+} precache_memo_t;
+
+static precache_memo_t *precache_memo[PRECACHE_NUM_KINDS][PRECACHE_HASH_SIZE];
+
+static uint32_t wasm_precache_hash(const char *name)
+{
+	uint32_t hash = 2166136261u;
+
+	for (; *name; name++)
+		hash = (hash ^ (uint8_t) *name) * 16777619u;
+
+	return hash & (PRECACHE_HASH_SIZE - 1);
+}
+
+static precache_memo_t **wasm_precache_find(precache_kind_t kind, const char *name)
+{
+	precache_memo_t **memo = &precache_memo[kind][wasm_precache_hash(name)];
+
+	for (; *memo; memo = &(*memo)->next)
+		if (!strcmp((*memo)->name, name))
+			break;
+
+	return memo;
+}
+
+static void wasm_precache_remember(precache_kind_t kind, const char *name, int32_t index)
+{
+	precache_memo_t **memo = wasm_precache_find(kind, name);
+
+	if (*memo)
+		return;
+
+	const size_t len = strlen(name) + 1;
+
+	if (!(*memo = (precache_memo_t *) malloc(sizeof(precache_memo_t) + len)))
+		return;
+
+	(*memo)->next = NULL;
+	(*memo)->index = index;
+	memcpy((*memo)->name, name, len);
+}
+
+static void wasm_precache_clear(void)
+{
+	for (int32_t k = 0; k < PRECACHE_NUM_KINDS; k++)
+	{
+		for (int32_t i = 0; i < PRECACHE_HASH_SIZE; i++)
+		{
+			for (precache_memo_t *memo = precache_memo[k][i], *next; memo; memo = next)
+			{
+				next = memo->next;
+				free(memo);
+			}
+
+			precache_memo[k][i] = NULL;
+		}
+	}
+}
+
+static int32_t wasm_precache_index(precache_kind_t kind, const char *name, int32_t (*import)(const char *))
+{
+	if (!name || !*name)
+		return import(name);
+
+	precache_memo_t **memo = wasm_precache_find(kind, name);
+
+	if (*memo)
+		return (*memo)->index;
+
+	const int32_t index = import(name);
+
+	// 0 is what the engine hands out for names it doesn't keep
+	if (index)
+		wasm_precache_remember(kind, name, index);
+
+	return index;
+}
+
+static int32_t wasm_wrap_modelindex(const char *name)
+{
+	return wasm_precache_index(PRECACHE_MODEL, name, wasm_modelindex);
+}
+
+static int32_t wasm_wrap_soundindex(const char *name)
+{
+	return wasm_precache_index(PRECACHE_SOUND, name, wasm_soundindex);
+}
+
+static int32_t wasm_wrap_imageindex(const char *name)
+{
+	return wasm_precache_index(PRECACHE_IMAGE, name, wasm_imageindex);
+}
+
+static void wasm_wrap_configstring(int32_t id, const char *value)
+{
+	// overwriting an index directly makes whatever we knew about it
+	// stale; it's rare enough to just start over
+	if (id >= WASM_CS_MODELS && id < WASM_CS_LIGHTS)
+		wasm_precache_clear();
+
+	wasm_configstring(id, value);
+}
+
+void wasm_ext_precache_batch(wasm_precache_t *entries, uint32_t count)
+{
+	wasm_precache_batch(entries, count);
+
+	for (uint32_t i = 0; i < count; i++)
+		if (entries[i].index && entries[i].name)
+			wasm_precache_remember((precache_kind_t) entries[i].kind, (const char *) (uintptr_t) entries[i].name, entries[i].index);
+}
+
+/*	Save streams are wrapped in a FILE so that stdio does the small-write
+	buffering on our side, and the bridge only sees large chunks. */
+#define SAVE_STREAM_BUFFER	65536
+
+static ssize_t wasm_save_cookie_read(void *cookie, char *buf, size_t size)
+{
+	return wasm_save_read((int32_t) (intptr_t) cookie, buf, (uint32_t) size);
+}
+
+static ssize_t wasm_save_cookie_write(void *cookie, const char *buf, size_t size)
+{
+	return wasm_save_write((int32_t) (intptr_t) cookie, buf, (uint32_t) size);
+}
+
+static int wasm_save_cookie_close(void *cookie)
+{
+	return wasm_save_close((int32_t) (intptr_t) cookie) ? 0 : -1;
+}
+
+// the game's fopen may be routed here, but this one has to be the real one
+#undef fopen
+
+FILE *wasm_ext_save_fopen(const char *path, const char *mode)
+{
+	// appending and updating need seeking, which streams don't do
+	if (strncmp(path, ".saves/", 7) || strchr(mode, 'a') || strchr(mode, '+'))
+		return fopen(path, mode);
+
+	const qboolean write = strchr(mode, 'w') ? qtrue : qfalse;
+	const int32_t handle = wasm_save_open(path, write);
+
+	if (!handle)
+		return NULL;
+
+	static const cookie_io_functions_t funcs = {
+		.read = wasm_save_cookie_read,
+		.write = wasm_save_cookie_write,
+		.close = wasm_save_cookie_close
+	};
+
+	FILE *fp = fopencookie((void *) (intptr_t) handle, write ? "w" : "r", funcs);
+
+	if (!fp)
+	{
+		wasm_save_close(handle);
+		return NULL;
+	}
+
+	setvbuf(fp, NULL, _IOFBF, SAVE_STREAM_BUFFER);
+	return fp;
+}
+
 game_export_t *GetGameAPI (game_import_t *import);
 
 static game_export_t *_ge;
@@ -217,16 +583,16 @@ int32_t WASM_GetGameAPI(int32_t apiversion) WASM_EXPORT(GetGameAPI)
 		MAP_IMPORT_WRAPPED(dprintf),
 		MAP_IMPORT_WRAPPED(cprintf),
 		MAP_IMPORT_WRAPPED(centerprintf),
-		MAP_IMPORT(sound),
+		MAP_IMPORT_WRAPPED(sound),
 		MAP_IMPORT_WRAPPED(positioned_sound),
 
-		MAP_IMPORT(configstring),
+		MAP_IMPORT_WRAPPED(configstring),
 
 		MAP_IMPORT_WRAPPED(error),
 		
-		MAP_IMPORT(modelindex),
-		MAP_IMPORT(soundindex),
-		MAP_IMPORT(imageindex),
+		MAP_IMPORT_WRAPPED(modelindex),
+		MAP_IMPORT_WRAPPED(soundindex),
+		MAP_IMPORT_WRAPPED(imageindex),
 
 		MAP_IMPORT(setmodel),
 
@@ -243,16 +609,16 @@ int32_t WASM_GetGameAPI(int32_t apiversion) WASM_EXPORT(GetGameAPI)
 		MAP_IMPORT(Pmove),
 
 		MAP_IMPORT_WRAPPED(multicast),
-		MAP_IMPORT(unicast),
-		MAP_IMPORT(WriteChar),
-		MAP_IMPORT(WriteByte),
-		MAP_IMPORT(WriteShort),
-		MAP_IMPORT(WriteLong),
-		MAP_IMPORT(WriteFloat),
-		MAP_IMPORT(WriteString),
+		MAP_IMPORT_WRAPPED(unicast),
+		MAP_IMPORT_WRAPPED(WriteChar),
+		MAP_IMPORT_WRAPPED(WriteByte),
+		MAP_IMPORT_WRAPPED(WriteShort),
+		MAP_IMPORT_WRAPPED(WriteLong),
+		MAP_IMPORT_WRAPPED(WriteFloat),
+		MAP_IMPORT_WRAPPED(WriteString),
 		MAP_IMPORT_WRAPPED(WritePosition),
 		MAP_IMPORT_WRAPPED(WriteDir),
-		MAP_IMPORT(WriteAngle),
+		MAP_IMPORT_WRAPPED(WriteAngle),
 
 		MAP_IMPORT(TagMalloc),
 		MAP_IMPORT(TagFree),
@@ -271,6 +637,8 @@ int32_t WASM_GetGameAPI(int32_t apiversion) WASM_EXPORT(GetGameAPI)
 		MAP_IMPORT(DebugGraph)
 	};
 
+	defer_queue = wasm_GetDeferQueue();
+
 	_ge = GetGameAPI(&_gi);
 
 	return GAME_API_EXTENDED_VERSION;
@@ -303,6 +671,7 @@ void WASM_Init(void) WASM_EXPORT(Init)
 
 void WASM_SpawnEntities(const char *mapname, const char *entities, const char *spawnpoint) WASM_EXPORT(SpawnEntities)
 {
+	wasm_precache_clear();
 	_ge->SpawnEntities(mapname, entities, spawnpoint);
 }
 
@@ -375,6 +744,7 @@ void WASM_WriteLevel(const char *filename) WASM_EXPORT(WriteLevel)
 
 void WASM_ReadLevel(const char *filename) WASM_EXPORT(ReadLevel)
 {
+	wasm_precache_clear();
 	_ge->ReadLevel(filename);
 }
 
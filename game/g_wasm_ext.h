@@ -0,0 +1,162 @@
+/*
+Copyright (C) 1997-2001 Id Software, Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+#pragma once
+
+// This file contains data shared between the bridge and the WASM side
+// for imports that go beyond what game_import_t provides. Everything in
+// here is laid out for the WASM side, so only fixed-size types are used.
+
+#include "g_api.h"
+
+//
+// network message buffering
+//
+// The shim encodes gi.Write* calls into a buffer in linear memory, and the
+// bridge replays the whole buffer with a single WriteMessage import. Each
+// primitive is an opcode byte followed by its little-endian payload.
+enum
+{
+	MSG_OP_CHAR,		// 1 byte
+	MSG_OP_BYTE,		// 1 byte
+	MSG_OP_SHORT,		// 2 bytes
+	MSG_OP_LONG,		// 4 bytes
+	MSG_OP_FLOAT,		// 4 bytes
+	MSG_OP_STRING,		// nul-terminated string
+	MSG_OP_POSITION,	// 3 floats
+	MSG_OP_DIR,			// 3 floats
+	MSG_OP_ANGLE		// 1 float
+};
+
+// large enough for any message the engine will send out, even
+// with the opcode overhead
+enum { MAX_WASM_MSGLEN = 16384 };
+
+//
+// client masks
+//
+// One bit per client slot (edict number - 1).
+enum { CLIENT_MASK_WORDS = MAX_CLIENTS / 32 };
+
+typedef uint32_t client_mask_t[CLIENT_MASK_WORDS];
+
+#define CLIENT_MASK_SET(m, i) \
+	((m)[(i) >> 5] |= 1u << ((i) & 31))
+#define CLIENT_MASK_TEST(m, i) \
+	(((m)[(i) >> 5] >> ((i) & 31)) & 1)
+
+#ifdef __wasm__
+// Sends the message written so far to every client set in clients, instead
+// of writing it out again for each gi.unicast. The matching bit in reliable
+// selects whether it goes out reliably to that client.
+void wasm_ext_unicast_mask(const client_mask_t clients, const client_mask_t reliable);
+#endif
+
+//
+// deferred imports
+//
+// When the bridge enables it, sounds and prints that don't return anything
+// are recorded into a queue in linear memory instead of crossing over
+// immediately. The bridge drains the queue in order at the end of every
+// export call, or sooner when something needs them to have gone out first.
+// Each record is an opcode byte followed by one of the structs below.
+enum
+{
+	DEFER_OP_SOUND,				// wasm_defer_sound_t
+	DEFER_OP_POSITIONED_SOUND,	// wasm_defer_sound_t
+	DEFER_OP_BPRINT,			// wasm_defer_print_t + string
+	DEFER_OP_CPRINT,			// wasm_defer_print_t + string
+	DEFER_OP_CENTERPRINT		// wasm_defer_print_t + string, level unused
+};
+
+typedef struct
+{
+	uint32_t		ent;
+	sound_channel_t	channel;
+	int32_t			soundindex;
+	vec_t			volume;
+	sound_attn_t	attenuation;
+	vec_t			timeofs;
+	vec3_t			origin;		// positioned sounds only
+} wasm_defer_sound_t;
+
+typedef struct
+{
+	uint32_t		ent;
+	print_level_t	level;
+} wasm_defer_print_t;
+
+typedef struct
+{
+	uint32_t	length;		// bytes used in data
+	uint32_t	size;		// bytes available in data
+	uint32_t	count;		// records in data
+	uint8_t		data[];
+} wasm_defer_queue_t;
+
+enum { WASM_DEFER_QUEUE_SIZE = 65536 };
+
+//
+// batched precaching
+//
+// Resolves a whole list of model, sound and image names to their
+// indices with a single crossing.
+typedef enum
+{
+	PRECACHE_MODEL,
+	PRECACHE_SOUND,
+	PRECACHE_IMAGE,
+
+	PRECACHE_NUM_KINDS
+} precache_kind_t;
+
+typedef struct
+{
+	uint32_t	kind;		// precache_kind_t
+	uint32_t	name;		// const char *
+	int32_t		index;		// filled in by the bridge
+} wasm_precache_t;
+
+#ifdef __wasm__
+// Fills in the index of every entry. Results are also remembered by the
+// shim, so later gi.modelindex etc calls for the same names this level
+// don't have to cross over at all.
+void wasm_ext_precache_batch(wasm_precache_t *entries, uint32_t count);
+#endif
+
+//
+// save streams
+//
+// Native file I/O for savegames, bypassing WASI. Paths are the same
+// .saves/ paths the bridge hands to WriteGame and friends.
+#ifdef __wasm__
+#include <stdio.h>
+
+// Opens paths under .saves/ through the bridge's save streams, and
+// anything else with the regular fopen. The returned FILE only supports
+// sequential reads or writes. Define WASM_NATIVE_SAVE_IO when building
+// the game, and include this after stdio.h, to route its own fopen calls
+// through here.
+FILE *wasm_ext_save_fopen(const char *path, const char *mode);
+
+#ifdef WASM_NATIVE_SAVE_IO
+#define fopen wasm_ext_save_fopen
+#endif
+#endif